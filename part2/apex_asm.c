@@ -0,0 +1,34 @@
+/*
+ *  apex_asm.c
+ *  Converts an APEX assembly file into a binary object file that
+ *  apex_sim maps directly as code memory
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+
+int
+main(int argc, char const* argv[])
+{
+  if (argc != 3) {
+    fprintf(stderr, "APEX_Help : Usage %s <input_file> <object_file>\n", argv[0]);
+    exit(1);
+  }
+
+  int size = 0;
+  APEX_Instruction* code = create_code_memory(argv[1], &size);
+  if (!code) {
+    fprintf(stderr, "APEX_Error : Unable to assemble %s\n", argv[1]);
+    exit(1);
+  }
+
+  if (write_object_file(argv[2], code, size) < 0) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", argv[2]);
+    free(code);
+    exit(1);
+  }
+
+  free(code);
+  return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ *  apex_trace.c
+ *  Renders a binary trace written by apex_sim --trace as the per-cycle
+ *  pipeline view that apex_sim prints in display mode
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+int
+main(int argc, char const* argv[])
+{
+  if (argc != 3) {
+    fprintf(stderr, "APEX_Help : Usage %s <input_file> <trace_file>\n",
+            argv[0]);
+    exit(1);
+  }
+
+  setvbuf(stdout, NULL, _IOFBF, APEX_OUTPUT_BUFFER_SIZE);
+  APEX_CPU* cpu = APEX_cpu_load(argv[1]);
+  if (!cpu) {
+    fprintf(stderr, "APEX_Error : Unable to load %s\n", argv[1]);
+    exit(1);
+  }
+
+  FILE* fp = fopen(argv[2], "rb");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open %s\n", argv[2]);
+    APEX_cpu_stop(cpu);
+    exit(1);
+  }
+
+  APEX_Trace_Header header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, APEX_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != APEX_TRACE_VERSION ||
+      header.record_size != sizeof(APEX_Trace_Record) ||
+      fseek(fp, header.header_size, SEEK_SET) != 0) {
+    fprintf(stderr, "APEX_Error : %s is not a valid trace\n", argv[2]);
+    fclose(fp);
+    APEX_cpu_stop(cpu);
+    exit(1);
+  }
+  if (header.code_size != (uint32_t)cpu->code_memory_size ||
+      header.code_checksum != APEX_cpu_code_checksum(cpu)) {
+    fprintf(stderr, "APEX_Error : %s was not traced from %s\n", argv[2],
+            argv[1]);
+    fclose(fp);
+    APEX_cpu_stop(cpu);
+    exit(1);
+  }
+  if (APEX_cpu_set_pipeline(cpu, header.depth) != 0) {
+    fclose(fp);
+    APEX_cpu_stop(cpu);
+    exit(1);
+  }
+
+  /* Stages show their latches from writeback back to fetch */
+  APEX_Trace_Record record;
+  while (fread(&record, sizeof(record), 1, fp) == 1) {
+    printf("--------------------------------\n");
+    printf("Clock Cycle #: %u\n", record.clock + 1);
+    printf("--------------------------------\n");
+    for (int id = WB; id >= F; --id) {
+      const APEX_Trace_Stage* shown = &record.stage[id];
+      if (!(shown->flags & APEX_TRACE_SHOWN) || !cpu->stage_name[id]) {
+        continue;
+      }
+
+      CPU_Stage stage;
+      memset(&stage, 0, sizeof(stage));
+      stage.pc = shown->pc;
+      stage.index = (shown->index >= 0 && shown->index < cpu->code_memory_size)
+                      ? shown->index
+                      : 0;
+      stage.opcode = shown->opcode < NUM_OPCODES ? shown->opcode : OPCODE_NONE;
+      stage.busy = (shown->flags & APEX_TRACE_BUSY) != 0;
+      stage.stalled = (shown->flags & APEX_TRACE_STALLED) != 0;
+      APEX_print_stage(cpu, id, &stage);
+    }
+    printf("Clock : %u \n", record.clock + 2);
+  }
+
+  fclose(fp);
+  APEX_cpu_stop(cpu);
+  return 0;
+}
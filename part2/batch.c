@@ -0,0 +1,294 @@
+/*
+ *  batch.c
+ *  Runs many (program, cycle budget) jobs from a manifest on a pool of
+ *  threads, one APEX cpu per job, and prints one result row per job
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+/* One line of the manifest and the state it ends in */
+typedef struct APEX_Batch_Job
+{
+  char* filename;
+  int cycles;
+  int loaded;		// Program could be loaded
+  APEX_Stats stats;
+  int regs[APEX_NUM_REGS];
+} APEX_Batch_Job;
+
+/* Every worker owns a contiguous range [lo, hi) of job indices, packed into
+ * one word so that the owner and thieves claim jobs with a single CAS. The
+ * owner takes jobs from the low end, an idle worker steals the upper half
+ * of a victim's range.
+ */
+typedef struct APEX_Batch_Worker
+{
+  _Atomic uint64_t range;
+  struct APEX_Batch_Pool* pool;
+  pthread_t thread;
+  int started;		// Thread created, to be joined
+} APEX_Batch_Worker;
+
+typedef struct APEX_Batch_Pool
+{
+  APEX_Batch_Job* jobs;
+  APEX_Batch_Worker* workers;
+  int num_workers;
+} APEX_Batch_Pool;
+
+static inline uint64_t
+pack_range(uint32_t lo, uint32_t hi)
+{
+  return ((uint64_t)hi << 32) | lo;
+}
+
+/* Claims the next job of the worker's own range, -1 if it is empty */
+static int
+take_own(APEX_Batch_Worker* worker)
+{
+  uint64_t range = atomic_load(&worker->range);
+  for (;;) {
+    uint32_t lo = (uint32_t)range;
+    uint32_t hi = (uint32_t)(range >> 32);
+    if (lo >= hi) {
+      return -1;
+    }
+    if (atomic_compare_exchange_weak(&worker->range, &range,
+                                     pack_range(lo + 1, hi))) {
+      return lo;
+    }
+  }
+}
+
+/* Moves the upper half of some victim's range into the (empty) range of
+ * the thief, returns 0 if every other worker is out of jobs
+ */
+static int
+steal(APEX_Batch_Worker* thief)
+{
+  APEX_Batch_Pool* pool = thief->pool;
+  int self = thief - pool->workers;
+
+  for (int i = 1; i < pool->num_workers; ++i) {
+    APEX_Batch_Worker* victim =
+      &pool->workers[(self + i) % pool->num_workers];
+    uint64_t range = atomic_load(&victim->range);
+    for (;;) {
+      uint32_t lo = (uint32_t)range;
+      uint32_t hi = (uint32_t)(range >> 32);
+      if (lo >= hi) {
+        break;
+      }
+      uint32_t split = hi - (hi - lo + 1) / 2;
+      if (atomic_compare_exchange_weak(&victim->range, &range,
+                                       pack_range(lo, split))) {
+        atomic_store(&thief->range, pack_range(split, hi));
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void
+run_job(APEX_Batch_Job* job)
+{
+  APEX_CPU* cpu = APEX_cpu_load(job->filename);
+  if (!cpu) {
+    return;
+  }
+
+  APEX_cpu_run_cycles(cpu, job->cycles);
+  APEX_cpu_get_stats(cpu, &job->stats);
+  memcpy(job->regs, cpu->regs, sizeof(job->regs));
+  job->loaded = 1;
+  APEX_cpu_stop(cpu);
+}
+
+static void*
+worker_main(void* arg)
+{
+  APEX_Batch_Worker* worker = arg;
+  do {
+    int job;
+    while ((job = take_own(worker)) >= 0) {
+      run_job(&worker->pool->jobs[job]);
+    }
+  } while (steal(worker));
+  return NULL;
+}
+
+static void
+free_jobs(APEX_Batch_Job* jobs, int count)
+{
+  for (int i = 0; i < count; ++i) {
+    free(jobs[i].filename);
+  }
+  free(jobs);
+}
+
+/*
+ * Reads "<input_file> <cycles>" lines, skipping blank lines and lines
+ * starting with '#'. Returns the number of jobs, -1 on error.
+ */
+static int
+read_manifest(const char* manifest, APEX_Batch_Job** jobs)
+{
+  FILE* fp = fopen(manifest, "r");
+  if (!fp) {
+    return -1;
+  }
+
+  char* line = NULL;
+  size_t len = 0;
+  int count = 0;
+  int capacity = 0;
+  int line_num = 0;
+  int failed = 0;
+  *jobs = NULL;
+  while (getline(&line, &len, fp) != -1) {
+    char filename[4096];
+    int cycles;
+    line_num++;
+
+    char* start = line + strspn(line, " \t");
+    if (*start == '#' || *start == '\n' || *start == '\0') {
+      continue;
+    }
+    if (sscanf(start, "%4095s %d", filename, &cycles) != 2 || cycles < 0) {
+      fprintf(stderr, "APEX_Batch : %s:%d: expected <input_file> <cycles>\n",
+              manifest, line_num);
+      continue;
+    }
+
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      APEX_Batch_Job* grown = realloc(*jobs, sizeof(**jobs) * capacity);
+      if (!grown) {
+        failed = 1;
+        break;
+      }
+      *jobs = grown;
+    }
+    memset(&(*jobs)[count], 0, sizeof(**jobs));
+    (*jobs)[count].filename = strdup(filename);
+    if (!(*jobs)[count].filename) {
+      failed = 1;
+      break;
+    }
+    (*jobs)[count].cycles = cycles;
+    count++;
+  }
+
+  free(line);
+  fclose(fp);
+  if (failed) {
+    free_jobs(*jobs, count);
+    *jobs = NULL;
+    return -1;
+  }
+  return count;
+}
+
+/* Writes a CSV field, quoted with its quotes doubled if it holds a comma,
+ * quote or line break (RFC 4180)
+ */
+static void
+print_field(FILE* out, const char* field)
+{
+  if (!strpbrk(field, ",\"\r\n")) {
+    fputs(field, out);
+    return;
+  }
+  fputc('"', out);
+  for (const char* c = field; *c; ++c) {
+    if (*c == '"') {
+      fputc('"', out);
+    }
+    fputc(*c, out);
+  }
+  fputc('"', out);
+}
+
+/*
+ * Runs every job of the manifest on the given number of threads (0 picks
+ * one per online processor) and writes one CSV row per job, in manifest
+ * order, to out. Returns 0 if every program could be loaded.
+ */
+int
+APEX_batch_run(const char* manifest, int threads, FILE* out)
+{
+  APEX_Batch_Job* jobs;
+  int num_jobs = read_manifest(manifest, &jobs);
+  if (num_jobs < 0) {
+    fprintf(stderr, "APEX_Batch : Unable to read manifest %s\n", manifest);
+    return -1;
+  }
+
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads > num_jobs) {
+    threads = num_jobs;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  /* Deal out equal ranges, stealing evens out the differences in run time */
+  APEX_Batch_Pool pool = { jobs, calloc(threads, sizeof(APEX_Batch_Worker)),
+                           threads };
+  if (!pool.workers) {
+    free_jobs(jobs, num_jobs);
+    return -1;
+  }
+  for (int i = 0; i < threads; ++i) {
+    uint32_t lo = (uint64_t)num_jobs * i / threads;
+    uint32_t hi = (uint64_t)num_jobs * (i + 1) / threads;
+    atomic_init(&pool.workers[i].range, pack_range(lo, hi));
+    pool.workers[i].pool = &pool;
+  }
+  /* The range of a worker whose thread could not be created is left to
+   * the others, which steal it like any other
+   */
+  for (int i = 1; i < threads; ++i) {
+    pool.workers[i].started =
+      pthread_create(&pool.workers[i].thread, NULL, worker_main,
+                     &pool.workers[i]) == 0;
+  }
+  worker_main(&pool.workers[0]);
+  for (int i = 1; i < threads; ++i) {
+    if (pool.workers[i].started) {
+      pthread_join(pool.workers[i].thread, NULL);
+    }
+  }
+
+  int failed = 0;
+  fprintf(out, "input,cycles,status,clock,ins_completed,pc");
+  for (int r = 0; r < APEX_NUM_REGS; ++r) {
+    fprintf(out, ",R%d", r);
+  }
+  fprintf(out, "\n");
+  for (int i = 0; i < num_jobs; ++i) {
+    APEX_Batch_Job* job = &jobs[i];
+    print_field(out, job->filename);
+    fprintf(out, ",%d,%s,%d,%d,%d", job->cycles,
+            job->loaded ? "ok" : "error", job->stats.clock,
+            job->stats.ins_completed, job->stats.pc);
+    for (int r = 0; r < APEX_NUM_REGS; ++r) {
+      fprintf(out, ",%d", job->regs[r]);
+    }
+    fprintf(out, "\n");
+    failed |= !job->loaded;
+  }
+
+  free(pool.workers);
+  free_jobs(jobs, num_jobs);
+  return failed ? -1 : 0;
+}
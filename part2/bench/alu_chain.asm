@@ -0,0 +1,13 @@
+MOVC,R1,#1
+MOVC,R2,#3
+MOVC,R3,#5
+ADD,R4,R1,R2
+SUB,R5,R4,R3
+AND,R6,R5,R4
+OR,R7,R6,R2
+EX-OR,R8,R7,R5
+ADDL,R9,R8,#7
+SUB,R10,R9,R3
+ADD,R1,R1,R2
+BNZ,#-32
+HALT
@@ -0,0 +1,270 @@
+/*
+ *  apex_bench.c
+ *  Measures how fast the simulator itself runs: every program is simulated
+ *  silently for a fixed number of cycles, several times, and the host time
+ *  is reported as simulated cycles per second and nanoseconds per stage
+ *  call. A baseline file saved by an earlier run flags the programs that
+ *  got slower.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu.h"
+
+#define BENCH_MAX_BASELINES 64
+
+/* Time per stage call of one program, as saved in a baseline file */
+typedef struct Bench_Baseline
+{
+  char name[64];
+  int depth;
+  double ns_per_stage;
+  double stddev;
+} Bench_Baseline;
+
+typedef struct Bench_Options
+{
+  int cycles;		// Cycles simulated by each run
+  int repeats;		// Timed runs per program
+  int depth;		// Pipeline depth
+  double tolerance;	// Slowdown over the baseline flagged, in percent
+  const char* baseline;	// Baseline file to compare with, NULL for none
+  const char* save;	// File to save the results in, NULL for none
+} Bench_Options;
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Program name without directory and extension */
+static void
+program_name(const char* filename, char* name, size_t size)
+{
+  const char* base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+  snprintf(name, size, "%s", base);
+  char* dot = strrchr(name, '.');
+  if (dot && dot != name) {
+    *dot = '\0';
+  }
+}
+
+/*
+ * Simulates filename for the given cycles and stores the host time taken in
+ * ns. Returns 0 on success, 1 if the program finished early, -1 on error.
+ */
+static int
+time_run(const char* filename, const Bench_Options* options, double* ns)
+{
+  APEX_CPU* cpu = APEX_cpu_load(filename);
+  if (!cpu) {
+    return -1;
+  }
+  if (APEX_cpu_set_pipeline(cpu, options->depth) != 0) {
+    APEX_cpu_stop(cpu);
+    return -1;
+  }
+
+  double start = now_ns();
+  APEX_cpu_run_cycles(cpu, options->cycles);
+  *ns = now_ns() - start;
+
+  int finished = cpu->counters.idle > 0;
+  APEX_cpu_stop(cpu);
+  return finished;
+}
+
+/* Reads "<name> <depth> <ns_per_stage> <stddev>" lines, -1 on error */
+static int
+read_baselines(const char* filename, Bench_Baseline* baselines)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "APEX_Bench : Unable to read %s\n", filename);
+    return -1;
+  }
+
+  char line[256];
+  int count = 0;
+  while (count < BENCH_MAX_BASELINES && fgets(line, sizeof(line), fp)) {
+    Bench_Baseline* baseline = &baselines[count];
+    if (line[0] == '#') {
+      continue;
+    }
+    if (sscanf(line, "%63s %d %lf %lf", baseline->name, &baseline->depth,
+               &baseline->ns_per_stage, &baseline->stddev) == 4) {
+      count++;
+    }
+  }
+  fclose(fp);
+  return count;
+}
+
+static const Bench_Baseline*
+find_baseline(const Bench_Baseline* baselines, int count, const char* name,
+              int depth)
+{
+  for (int i = 0; i < count; ++i) {
+    if (baselines[i].depth == depth && strcmp(baselines[i].name, name) == 0) {
+      return &baselines[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Runs every program and prints a row of results for it. Returns the
+ * number of programs slower than their baseline, -1 on error.
+ */
+static int
+run_bench(char* const* programs, int count, const Bench_Options* options)
+{
+  Bench_Baseline baselines[BENCH_MAX_BASELINES];
+  int num_baselines = 0;
+  if (options->baseline) {
+    num_baselines = read_baselines(options->baseline, baselines);
+    if (num_baselines < 0) {
+      return -1;
+    }
+  }
+
+  FILE* save = NULL;
+  if (options->save) {
+    save = fopen(options->save, "w");
+    if (!save) {
+      fprintf(stderr, "APEX_Bench : Unable to write %s\n", options->save);
+      return -1;
+    }
+    fprintf(save, "# program depth ns_per_stage stddev (%d cycles, %d runs)\n",
+            options->cycles, options->repeats);
+  }
+
+  int regressions = 0;
+  double stage_calls = (double)options->cycles * options->depth;
+  for (int p = 0; p < count; ++p) {
+    char name[64];
+    program_name(programs[p], name, sizeof(name));
+
+    /* One untimed run first, so that every timed one starts warm */
+    double ns;
+    int status = time_run(programs[p], options, &ns);
+    if (status < 0) {
+      fprintf(stderr, "APEX_Bench : Unable to run %s\n", programs[p]);
+      regressions = -1;
+      break;
+    }
+    if (status > 0) {
+      fprintf(stderr,
+              "APEX_Bench : %s finishes within %d cycles, idle cycles are"
+              " skipped and not timed\n",
+              programs[p], options->cycles);
+    }
+    if (p == 0) {
+      printf("%-16s %5s %14s %9s %16s", "program", "depth", "Mcycles/s",
+             "ns/stage", "stddev ns/stage");
+      printf(options->baseline ? " %9s\n" : "\n", "baseline");
+    }
+
+    double sum = 0, sum_squares = 0;
+    for (int r = 0; r < options->repeats; ++r) {
+      time_run(programs[p], options, &ns);
+      double per_stage = ns / stage_calls;
+      sum += per_stage;
+      sum_squares += per_stage * per_stage;
+    }
+    double mean = sum / options->repeats;
+    double variance = 0;
+    if (options->repeats > 1) {
+      variance = (sum_squares - sum * mean) / (options->repeats - 1);
+    }
+    double stddev = variance > 0 ? sqrt(variance) : 0;
+
+    printf("%-16s %5d %14.2f %9.2f %16.2f", name, options->depth,
+           1e3 / (mean * options->depth), mean, stddev);
+    const Bench_Baseline* baseline =
+      find_baseline(baselines, num_baselines, name, options->depth);
+    if (baseline) {
+      double change = (mean / baseline->ns_per_stage - 1) * 100;
+      double noise =
+        sqrt(stddev * stddev + baseline->stddev * baseline->stddev);
+      int slower = change > options->tolerance &&
+                   mean - baseline->ns_per_stage > 2 * noise;
+      printf(" %+8.1f%%%s", change, slower ? "  REGRESSION" : "");
+      regressions += slower;
+    } else if (options->baseline) {
+      printf(" %9s", "-");
+    }
+    printf("\n");
+
+    if (save) {
+      fprintf(save, "%s %d %.3f %.3f\n", name, options->depth, mean, stddev);
+    }
+  }
+
+  if (save && fclose(save) != 0 && regressions >= 0) {
+    fprintf(stderr, "APEX_Bench : Unable to write %s\n", options->save);
+    return -1;
+  }
+  return regressions;
+}
+
+int
+main(int argc, char const* argv[])
+{
+  Bench_Options options = { 1000000, 5, APEX_DEFAULT_DEPTH, 10, NULL, NULL };
+  char** programs = malloc(sizeof(char*) * argc);
+  int count = 0;
+  int bad_option = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--cycles=", 9) == 0) {
+      options.cycles = atoi(argv[i] + 9);
+      bad_option |= options.cycles < 1;
+    } else if (strncmp(argv[i], "--repeats=", 10) == 0) {
+      options.repeats = atoi(argv[i] + 10);
+      bad_option |= options.repeats < 1;
+    } else if (strncmp(argv[i], "--depth=", 8) == 0) {
+      options.depth = atoi(argv[i] + 8);
+    } else if (strncmp(argv[i], "--tolerance=", 12) == 0) {
+      options.tolerance = atof(argv[i] + 12);
+    } else if (strncmp(argv[i], "--baseline=", 11) == 0) {
+      options.baseline = argv[i] + 11;
+    } else if (strncmp(argv[i], "--save=", 7) == 0) {
+      options.save = argv[i] + 7;
+    } else if (argv[i][0] == '-') {
+      bad_option = 1;
+    } else {
+      programs[count++] = (char*)argv[i];
+    }
+  }
+
+  if (bad_option || count == 0) {
+    fprintf(stderr,
+            "APEX_Help : Usage %s [--cycles=<n>] [--repeats=<n>]"
+            " [--depth=5|7|9]\n"
+            "           [--baseline=<file>] [--tolerance=<percent>]"
+            " [--save=<file>] <input_file>...\n",
+            argv[0]);
+    free(programs);
+    return 2;
+  }
+
+  int regressions = run_bench(programs, count, &options);
+  free(programs);
+  if (regressions < 0) {
+    return 2;
+  }
+  if (regressions > 0) {
+    fprintf(stderr, "APEX_Bench : %d program(s) slower than the baseline\n",
+            regressions);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,7 @@
+MOVC,R1,#1
+MOVC,R4,#4
+ADD,R5,R5,R1
+SUB,R4,R4,R1
+BZ,#-12
+BNZ,#-12
+HALT
@@ -0,0 +1,13 @@
+MOVC,R1,#0
+MOVC,R2,#1
+MOVC,R7,#1023
+LOAD,R3,R1,#0
+ADD,R3,R3,R2
+STORE,R3,R1,#0
+LOAD,R4,R1,#1024
+ADD,R5,R5,R4
+ADDL,R1,R1,#1
+AND,R1,R1,R7
+ADD,R6,R2,R1
+BNZ,#-32
+HALT
@@ -0,0 +1,10 @@
+MOVC,R1,#3
+MOVC,R2,#5
+MOVC,R3,#7
+MUL,R2,R2,R1
+MUL,R3,R3,R1
+ADD,R6,R6,R2
+MUL,R4,R2,R3
+MUL,R5,R4,R1
+BNZ,#-20
+HALT
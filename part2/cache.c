@@ -0,0 +1,275 @@
+/*
+ *  cache.c
+ *  L1 cache model of the data cache in the MEM stages and the instruction
+ *  cache in front of fetch: the latency of every access follows from the
+ *  lines the cache holds, its replacement policy and its write policy
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+static const char* const replacement_names[APEX_NUM_REPLACEMENTS] = {
+  [APEX_REPLACE_LRU] = "lru",
+  [APEX_REPLACE_PLRU] = "plru",
+  [APEX_REPLACE_RANDOM] = "random",
+};
+
+static int
+is_power_of_two(int value)
+{
+  return value > 0 && (value & (value - 1)) == 0;
+}
+
+static int
+log2_of(int value)
+{
+  int bits = 0;
+  while ((1 << bits) < value) {
+    bits++;
+  }
+  return bits;
+}
+
+/* Bytes of a cache with its tree bits and lines in the same block */
+static size_t
+cache_bytes(int sets, int ways)
+{
+  return sizeof(APEX_Cache) + sizeof(int) * sets +
+         sizeof(APEX_Cache_Line) * sets * ways;
+}
+
+/* Points the tree bits and lines of a cache at the block behind it */
+static void
+place_arrays(APEX_Cache* cache)
+{
+  cache->plru = (int*)(cache + 1);
+  cache->lines = (APEX_Cache_Line*)(cache->plru + cache->sets);
+}
+
+/* Reads one key=value item of a configuration, returns 0 on success */
+static int
+parse_item(APEX_Cache_Config* config, const char* item, size_t length)
+{
+  const char* value = memchr(item, '=', length);
+  if (!value) {
+    return -1;
+  }
+  size_t key_length = value - item;
+  size_t value_length = length - key_length - 1;
+  value++;
+
+  if (key_length == 7 && strncmp(item, "replace", 7) == 0) {
+    for (int i = 0; i < APEX_NUM_REPLACEMENTS; ++i) {
+      if (strlen(replacement_names[i]) == value_length &&
+          strncmp(value, replacement_names[i], value_length) == 0) {
+        config->replacement = i;
+        return 0;
+      }
+    }
+    return -1;
+  }
+  if (key_length == 5 && strncmp(item, "write", 5) == 0) {
+    if (value_length == 4 && strncmp(value, "back", 4) == 0) {
+      config->write_back = 1;
+    } else if (value_length == 7 && strncmp(value, "through", 7) == 0) {
+      config->write_back = 0;
+    } else {
+      return -1;
+    }
+    return 0;
+  }
+
+  static const struct
+  {
+    const char* key;
+    size_t offset;
+  } numbers[] = {
+    { "size", offsetof(APEX_Cache_Config, size) },
+    { "ways", offsetof(APEX_Cache_Config, ways) },
+    { "line", offsetof(APEX_Cache_Config, line) },
+    { "hit", offsetof(APEX_Cache_Config, hit_latency) },
+    { "miss", offsetof(APEX_Cache_Config, miss_latency) },
+  };
+  for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); ++i) {
+    if (strlen(numbers[i].key) == key_length &&
+        strncmp(item, numbers[i].key, key_length) == 0) {
+      char* end;
+      long number = strtol(value, &end, 10);
+      if (end != value + value_length || number <= 0 || number > 1 << 20) {
+        return -1;
+      }
+      *(int*)((char*)config + numbers[i].offset) = number;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Creates an empty cache configured by spec, a comma separated list of
+ * size=, ways=, line=, replace=lru|plru|random, write=back|through, hit=
+ * and miss=. Omitted items keep a 256-word, 2-way, 4-word line, LRU,
+ * write-back cache with hit latency 1 and miss latency 10. Returns NULL
+ * for an invalid configuration.
+ */
+APEX_Cache*
+APEX_cache_create(const char* spec)
+{
+  APEX_Cache_Config config = { 256, 2, 4, APEX_REPLACE_LRU, 1, 1, 10 };
+
+  while (spec && *spec) {
+    const char* end = strchr(spec, ',');
+    size_t length = end ? (size_t)(end - spec) : strlen(spec);
+    if (parse_item(&config, spec, length) != 0) {
+      return NULL;
+    }
+    spec = end ? end + 1 : NULL;
+  }
+  if (!is_power_of_two(config.size) || !is_power_of_two(config.ways) ||
+      !is_power_of_two(config.line) || config.ways > 32 ||
+      config.size < config.ways * config.line ||
+      config.miss_latency < config.hit_latency) {
+    return NULL;
+  }
+
+  int sets = config.size / (config.ways * config.line);
+  APEX_Cache* cache = calloc(1, cache_bytes(sets, config.ways));
+  if (!cache) {
+    return NULL;
+  }
+  cache->config = config;
+  cache->sets = sets;
+  cache->seed = 2463534242u;
+  place_arrays(cache);
+  return cache;
+}
+
+/*
+ * Duplicates a cache with everything it holds, NULL if out of memory
+ */
+APEX_Cache*
+APEX_cache_copy(const APEX_Cache* cache)
+{
+  size_t bytes = cache_bytes(cache->sets, cache->config.ways);
+  APEX_Cache* copy = malloc(bytes);
+  if (copy) {
+    memcpy(copy, cache, bytes);
+    place_arrays(copy);
+  }
+  return copy;
+}
+
+/* Records a use of a line for the replacement policy. The tree bits of a
+ * set point from the root towards the half to replace next, so a use turns
+ * each node on its path away from it.
+ */
+static void
+touch(APEX_Cache* cache, int set, int way)
+{
+  int ways = cache->config.ways;
+  unsigned bits = cache->plru[set];
+  int node = 1;
+
+  cache->lines[set * ways + way].stamp = cache->accesses;
+  for (int level = log2_of(ways) - 1; level >= 0; --level) {
+    int half = (way >> level) & 1;
+    bits = half ? bits & ~(1u << node) : bits | (1u << node);
+    node = node * 2 + half;
+  }
+  cache->plru[set] = bits;
+}
+
+/* The way of a set a missing line replaces: an invalid one if any, else
+ * the one chosen by the replacement policy
+ */
+static int
+victim(APEX_Cache* cache, int set)
+{
+  int ways = cache->config.ways;
+  const APEX_Cache_Line* lines = &cache->lines[set * ways];
+
+  for (int way = 0; way < ways; ++way) {
+    if (!lines[way].valid) {
+      return way;
+    }
+  }
+
+  switch (cache->config.replacement) {
+    case APEX_REPLACE_PLRU: {
+      unsigned bits = cache->plru[set];
+      int node = 1;
+      while (node < ways) {
+        node = node * 2 + ((bits >> node) & 1);
+      }
+      return node - ways;
+    }
+    case APEX_REPLACE_RANDOM: {
+      unsigned seed = cache->seed;
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      cache->seed = seed;
+      return seed & (ways - 1);
+    }
+    default: {
+      int oldest = 0;
+      for (int way = 1; way < ways; ++way) {
+        if ((unsigned)cache->accesses - (unsigned)lines[way].stamp >
+            (unsigned)cache->accesses - (unsigned)lines[oldest].stamp) {
+          oldest = way;
+        }
+      }
+      return oldest;
+    }
+  }
+}
+
+/*
+ * Looks up the line of a read (write 0) or write (write 1) of the word at
+ * address, filling it on a miss, and returns the cycles the access takes.
+ * Write-through writes always go on to memory and do not allocate; a
+ * write-back miss first writes back a dirty victim. The APEX_CACHE_*
+ * events of the access are counted in events.
+ */
+int
+APEX_cache_access(APEX_Cache* cache, long* events, int address, int write)
+{
+  const APEX_Cache_Config* config = &cache->config;
+  int block = address >> log2_of(config->line);
+  int set = block & (cache->sets - 1);
+  APEX_Cache_Line* lines = &cache->lines[set * config->ways];
+
+  cache->accesses = (int)((unsigned)cache->accesses + 1);
+  for (int way = 0; way < config->ways; ++way) {
+    if (lines[way].valid && lines[way].tag == block) {
+      events[APEX_CACHE_HIT]++;
+      touch(cache, set, way);
+      if (write && !config->write_back) {
+        return config->miss_latency;
+      }
+      lines[way].dirty |= write;
+      return config->hit_latency;
+    }
+  }
+
+  events[APEX_CACHE_MISS]++;
+  if (write && !config->write_back) {
+    return config->miss_latency;
+  }
+
+  int way = victim(cache, set);
+  int latency = config->miss_latency;
+  if (lines[way].valid) {
+    events[APEX_CACHE_EVICTION]++;
+    if (lines[way].dirty) {
+      events[APEX_CACHE_WRITEBACK]++;
+      latency += config->miss_latency;
+    }
+  }
+  lines[way].tag = block;
+  lines[way].valid = 1;
+  lines[way].dirty = write;
+  touch(cache, set, way);
+  return latency;
+}
@@ -0,0 +1,104 @@
+/*
+ *  counters.c
+ *  Reports the performance counters of an APEX cpu as a JSON object, so
+ *  that the efficiency of the simulated pipeline can be compared across
+ *  workloads
+ */
+#include <stdio.h>
+
+#include "cpu.h"
+
+/* Keys of the counters indexed by stall cause */
+static const char* const stall_keys[APEX_NUM_STALLS] = {
+  [APEX_STALL_RAW] = "raw",
+  [APEX_STALL_BRANCH] = "branch",
+  [APEX_STALL_HALT] = "halt_drain",
+  [APEX_STALL_ROB] = "rob_full",
+  [APEX_STALL_RS] = "rs_full",
+  [APEX_STALL_LSQ] = "lsq_full",
+  [APEX_STALL_UNIT] = "unit_busy",
+  [APEX_STALL_DCACHE] = "dcache",
+  [APEX_STALL_ICACHE] = "icache",
+};
+
+static const char* const cache_keys[APEX_NUM_CACHE_EVENTS] = {
+  [APEX_CACHE_HIT] = "hits",
+  [APEX_CACHE_MISS] = "misses",
+  [APEX_CACHE_EVICTION] = "evictions",
+  [APEX_CACHE_WRITEBACK] = "writebacks",
+};
+
+/* Prints a ratio, null when it is undefined */
+static void
+print_ratio(FILE* out, const char* key, long numerator, long denominator)
+{
+  if (denominator == 0) {
+    fprintf(out, "  \"%s\": null,\n", key);
+  } else {
+    fprintf(out, "  \"%s\": %.4f,\n", key, (double)numerator / denominator);
+  }
+}
+
+static void
+print_counts(FILE* out, const char* key, const char* const* names,
+             const long* counts, int count)
+{
+  fprintf(out, "  \"%s\": {", key);
+  for (int i = 0; i < count; ++i) {
+    fprintf(out, "%s \"%s\": %ld", i ? "," : "", names[i], counts[i]);
+  }
+  fprintf(out, " },\n");
+}
+
+/*
+ * Writes the counters of the cpu as one JSON object, returns 0 on success
+ */
+int
+APEX_cpu_write_report(const APEX_CPU* cpu, FILE* out)
+{
+  const APEX_Counters* counters = &cpu->counters;
+  long branches = counters->branches[0] + counters->branches[1];
+  long active = cpu->clock - counters->idle;
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"core\": \"%s\",\n",
+          cpu->core == APEX_CORE_OOO ? "out-of-order" : "in-order");
+  fprintf(out, "  \"width\": %d,\n", APEX_width(cpu));
+  fprintf(out, "  \"depth\": %d,\n", APEX_depth(cpu));
+  fprintf(out, "  \"cycles\": %d,\n", cpu->clock);
+  fprintf(out, "  \"idle_cycles\": %ld,\n", counters->idle);
+  fprintf(out, "  \"committed\": %ld,\n", counters->committed);
+  print_ratio(out, "cpi", active, counters->committed);
+  print_ratio(out, "ipc", counters->committed, active);
+  fprintf(out, "  \"fast_forwarded\": %ld,\n", cpu->fast_forwarded);
+  print_counts(out, "stalls", stall_keys, counters->stalls, APEX_NUM_STALLS);
+  fprintf(out, "  \"forwarding_saved\": %ld,\n", counters->forwarded);
+  fprintf(out, "  \"bubbles\": {");
+  for (int i = 0; i < APEX_depth(cpu); ++i) {
+    const APEX_Stage_Desc* stage = &cpu->pipeline.stages[i];
+    fprintf(out, "%s \"%s\": %ld", i ? "," : "", stage->key,
+            counters->bubbles[stage->in]);
+  }
+  fprintf(out, " },\n");
+  print_counts(out, "dcache", cache_keys, counters->dcache,
+               APEX_NUM_CACHE_EVENTS);
+  print_ratio(out, "dcache_hit_rate", counters->dcache[APEX_CACHE_HIT],
+              counters->dcache[APEX_CACHE_HIT] +
+                counters->dcache[APEX_CACHE_MISS]);
+  fprintf(out, "  \"store_forwards\": %ld,\n", counters->store_forwarded);
+  print_counts(out, "icache", cache_keys, counters->icache,
+               APEX_NUM_CACHE_EVENTS);
+  print_ratio(out, "icache_hit_rate", counters->icache[APEX_CACHE_HIT],
+              counters->icache[APEX_CACHE_HIT] +
+                counters->icache[APEX_CACHE_MISS]);
+  fprintf(out,
+          "  \"branches\": { \"taken\": %ld, \"not_taken\": %ld,"
+          " \"flushed\": %ld },\n",
+          counters->branches[1], counters->branches[0], counters->flushed);
+  fprintf(out, "  \"mispredicts\": %ld,\n", counters->mispredicts);
+  print_ratio(out, "prediction_accuracy", branches - counters->mispredicts,
+              branches);
+  fprintf(out, "  \"mispredict_penalty\": %ld\n", counters->penalty);
+  fprintf(out, "}\n");
+  return fflush(out) == 0 && !ferror(out) ? 0 : -1;
+}
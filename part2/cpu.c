@@ -6,76 +6,256 @@
  *  Gaurav Kothari (gkothar1@binghamton.edu)
  *  State University of New York, Binghamton
  */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "cpu.h"
 
-/* Set this flag to 1 to enable debug messages */
-#define ENABLE_DEBUG_MESSAGES 1
-int zeroFlag=1;
-int ptr=-1;
-int temp=0;
 
+/*
+ * Allocates an APEX cpu around already created code memory and puts it in
+ * its reset state
+ */
+static APEX_CPU*
+create_cpu(const APEX_Instruction* code_memory, int code_memory_size,
+           void* code_mapping, size_t code_mapping_size)
+{
+  APEX_CPU* cpu = calloc(1, sizeof(*cpu));
+  if (!cpu) {
+    return NULL;
+  }
+
+  cpu->code_memory = code_memory;
+  cpu->code_memory_size = code_memory_size;
+  cpu->code_mapping = code_mapping;
+  cpu->code_mapping_size = code_mapping_size;
+
+  /* Initialize PC, Registers and all pipeline stages */
+  cpu->pc = 4000;
+  for (int i = 0; i < APEX_NUM_REGS; ++i) {
+    cpu->regs_valid[i] = 1;
+  }
+  for (int i = 0; i < NUM_STAGES; ++i) {
+    cpu->stage[i] = cpu->latches[i];
+  }
+  cpu->width = APEX_START_WIDTH;
+  cpu->forwarding = APEX_START_FORWARDING;
+  cpu->predictor.kind = APEX_START_PREDICTOR;
+  cpu->fetch_buffer_size = 8;
+  APEX_units_reset(cpu->units);
+  cpu->ex_wait = -1;
+  APEX_memory_init(&cpu->memory, APEX_DATA_MEMORY_SIZE);
+  APEX_cpu_set_pipeline(cpu, APEX_START_DEPTH);
+
+  /* Make all stages busy except Fetch stage, initally to start the pipeline */
+  for (int i = 1; i < NUM_STAGES; ++i) {
+    cpu->stage[i]->busy = 1;
+  }
+
+  /* Branch state */
+  cpu->zero_flag = 1;
+  cpu->branch_wait = -1;
+
+  /* Pattern table counters start out weakly not taken */
+  memset(cpu->predictor.pht, 1, sizeof(cpu->predictor.pht));
+
+  cpu->out = stdout;
+  return cpu;
+}
 
 /*
- * This function creates and initializes APEX cpu.
- *
- * Note : You are free to edit this function according to your
- * 				implementation
+ * Creates an APEX cpu from an assembly or object file without printing
+ * anything
  */
 APEX_CPU*
-APEX_cpu_init(const char* filename)
+APEX_cpu_load(const char* filename)
 {
   if (!filename) {
     return NULL;
   }
 
-  APEX_CPU* cpu = malloc(sizeof(*cpu));
-  if (!cpu) {
+  /* Map an object file as code memory, or parse input file and create
+   * code memory
+   */
+  const APEX_Instruction* code_memory;
+  int code_memory_size = 0;
+  void* code_mapping = NULL;
+  size_t code_mapping_size = 0;
+  if (is_object_file(filename)) {
+    code_memory = map_object_file(
+      filename, &code_memory_size, &code_mapping, &code_mapping_size);
+  } else {
+    code_memory = create_code_memory(filename, &code_memory_size);
+  }
+
+  if (!code_memory) {
     return NULL;
   }
 
-  /* Initialize PC, Registers and all pipeline stages */
-  cpu->pc = 4000;
-  memset(cpu->regs, 0, sizeof(int) * 32);
-  memset(cpu->regs_valid, 1, sizeof(int) * 32);
-  memset(cpu->stage, 0, sizeof(CPU_Stage) * NUM_STAGES);
-  memset(cpu->data_memory, 0, sizeof(int) * 4000);
+  APEX_CPU* cpu = create_cpu(
+    code_memory, code_memory_size, code_mapping, code_mapping_size);
+  if (!cpu) {
+    if (code_mapping) {
+      munmap(code_mapping, code_mapping_size);
+    } else {
+      free((void*)code_memory);
+    }
+    return NULL;
+  }
+  return cpu;
+}
 
+/*
+ * Returns 0 if the cpu has the settings this build is specialized for,
+ * otherwise prints the setting it needs and returns -1
+ */
+int
+APEX_cpu_check_build(const APEX_CPU* cpu)
+{
+  static const char* const forwardings[] = { "none", "alu", "load", "all" };
+  static const char* const predictors[APEX_NUM_PREDICTORS] = {
+    "none", "static", "bimodal", "gshare"
+  };
+
+  if (APEX_FIXED_WIDTH && cpu->width != APEX_FIXED_WIDTH) {
+    fprintf(stderr, "APEX_Build : Specialized for --width=%d\n",
+            APEX_FIXED_WIDTH);
+    return -1;
+  }
+  if (APEX_FIXED_DEPTH && cpu->pipeline.depth != APEX_FIXED_DEPTH) {
+    fprintf(stderr, "APEX_Build : Specialized for --depth=%d\n",
+            APEX_FIXED_DEPTH);
+    return -1;
+  }
+  if (APEX_FIXED_FORWARDING >= 0 &&
+      cpu->forwarding != APEX_FIXED_FORWARDING) {
+    fprintf(stderr, "APEX_Build : Specialized for --forward=%s\n",
+            forwardings[APEX_START_FORWARDING]);
+    return -1;
+  }
+  if (APEX_FIXED_PREDICTOR >= 0 &&
+      cpu->predictor.kind != APEX_FIXED_PREDICTOR) {
+    fprintf(stderr, "APEX_Build : Specialized for --predict=%s\n",
+            predictors[APEX_START_PREDICTOR]);
+    return -1;
+  }
+  for (int i = 0; i < APEX_NUM_UNITS && APEX_FIXED_UNITS; ++i) {
+    if (cpu->units[i].latency != 1 || cpu->units[i].interval != 1) {
+      fprintf(stderr, "APEX_Build : Specialized for one-cycle units\n");
+      return -1;
+    }
+  }
+  return 0;
+}
 
+/*
+ * Maps the command given to apex_sim onto an output level, -1 if unknown.
+ * "simulate" and "display" are the summary and per-stage levels.
+ */
+int
+APEX_verbosity_from_command(const char* command)
+{
+  static const char* const commands[][2] = {
+    { "silent", "silent" },
+    { "simulate", "summary" },
+    { "cycle", "cycle" },
+    { "display", "stage" },
+  };
+
+  for (int i = 0; i < 4; ++i) {
+    if (strcmp(command, commands[i][0]) == 0 ||
+        strcmp(command, commands[i][1]) == 0) {
+      return APEX_VERBOSITY_SILENT + i;
+    }
+  }
+  return -1;
+}
 
-  /* Parse input file and create code memory */
-  cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size);
+/*
+ * Sets what the cpu prints and the stream it prints to. The stream is best
+ * fully buffered with APEX_OUTPUT_BUFFER_SIZE bytes.
+ */
+void
+APEX_cpu_set_output(APEX_CPU* cpu, int verbosity, FILE* out)
+{
+  cpu->verbosity = verbosity;
+  cpu->out = out;
+}
 
-  if (!cpu->code_memory) {
-    free(cpu);
+/*
+ * This function creates and initializes APEX cpu.
+ *
+ * Note : You are free to edit this function according to your
+ * 				implementation
+ */
+APEX_CPU*
+APEX_cpu_init(const char* filename, int verbosity)
+{
+  APEX_CPU* cpu = APEX_cpu_load(filename);
+  if (!cpu) {
     return NULL;
   }
+  cpu->verbosity = verbosity;
 
-  if (ENABLE_DEBUG_MESSAGES) {
+  if (cpu->verbosity >= APEX_VERBOSITY_STAGE) {
     fprintf(stderr,
             "APEX_CPU : Initialized APEX CPU, loaded %d instructions\n",
             cpu->code_memory_size);
     fprintf(stderr, "APEX_CPU : Printing Code Memory\n");
-    printf("%-9s %-9s %-9s %-9s %-9s\n", "opcode", "rd", "rs1", "rs2", "imm");
+    fprintf(cpu->out, "%-9s %-9s %-9s %-9s %-9s\n", "opcode", "rd", "rs1",
+            "rs2", "imm");
 
     for (int i = 0; i < cpu->code_memory_size; ++i) {
-      printf("%-9s %-9d %-9d %-9d %-9d\n",
-             cpu->code_memory[i].opcode,
-             cpu->code_memory[i].rd,
-             cpu->code_memory[i].rs1,
-             cpu->code_memory[i].rs2,
-             cpu->code_memory[i].imm);
+      APEX_Instruction ins = cpu->code_memory[i];
+      int flags = opcode_info[APEX_opcode(ins)].flags;
+      fprintf(cpu->out, "%-9s %-9d %-9d %-9d %-9d\n",
+             opcode_info[APEX_opcode(ins)].name,
+             (flags & OPF_RD) ? APEX_rd(ins) : 0,
+             (flags & OPF_RS1) ? APEX_rs1(ins) : 0,
+             (flags & OPF_RS2) ? APEX_rs2(ins) : 0,
+             (flags & OPF_IMM) ? APEX_imm(ins) : 0);
     }
   }
 
-  /* Make all stages busy except Fetch stage, initally to start the pipeline */
-  for (int i = 1; i < NUM_STAGES; ++i) {
-    cpu->stage[i].busy = 1;
+  return cpu;
+}
+
+/*
+ * Creates an APEX cpu from a program held in memory, either assembly text or
+ * the image of an object file. The program is copied, so the buffer may be
+ * released afterwards. The cpu is silent until APEX_cpu_set_output.
+ */
+APEX_CPU*
+APEX_cpu_init_from_buffer(const void* buffer, size_t size)
+{
+  if (!buffer) {
+    return NULL;
+  }
+
+  int code_memory_size = 0;
+  APEX_Instruction* code_memory;
+  const APEX_Instruction* words =
+    object_image_code(buffer, size, &code_memory_size);
+  if (words) {
+    code_memory = malloc(sizeof(*code_memory) * code_memory_size);
+    if (code_memory) {
+      memcpy(code_memory, words, sizeof(*code_memory) * code_memory_size);
+    }
+  } else {
+    code_memory = create_code_memory_from_buffer(buffer, size, &code_memory_size);
+  }
+
+  if (!code_memory) {
+    return NULL;
   }
 
+  APEX_CPU* cpu = create_cpu(code_memory, code_memory_size, NULL, 0);
+  if (!cpu) {
+    free(code_memory);
+  }
   return cpu;
 }
 
@@ -88,7 +268,18 @@ APEX_cpu_init(const char* filename)
 void
 APEX_cpu_stop(APEX_CPU* cpu)
 {
-  free(cpu->code_memory);
+  APEX_trace_close(cpu);
+  APEX_cpu_jit_release(cpu);
+  free(cpu->threaded_code);
+  free(cpu->ooo);
+  free(cpu->dcache);
+  free(cpu->icache);
+  APEX_memory_free(&cpu->memory);
+  if (cpu->code_mapping) {
+    munmap(cpu->code_mapping, cpu->code_mapping_size);
+  } else {
+    free((void*)cpu->code_memory);
+  }
   free(cpu);
 }
 
@@ -104,407 +295,731 @@ get_code_index(int pc)
   return (pc - 4000) / 4;
 }
 
+/* Instruction held by a latch */
+static inline APEX_Instruction
+latch_ins(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  return cpu->code_memory[stage->index];
+}
+
+/* Prints an instruction in its assembly form, operands in rd, rs1, rs2, imm
+ * order as given by the opcode's operand classes
+ */
 static void
-print_instruction(CPU_Stage* stage)
+print_instruction(APEX_CPU* cpu, CPU_Stage* stage)
 {
-  if (strcmp(stage->opcode, "STORE") == 0) {
-    printf(
-      "%s,R%d,R%d,#%d ", stage->opcode, stage->rs1, stage->rs2, stage->imm);
-  }
-  /*
+  APEX_Instruction ins = latch_ins(cpu, stage);
+  int flags = opcode_info[stage->opcode].flags;
 
-   if (strcmp(stage->opcode, "STR") == 0) {
-    printf(
-      "%s,R%d,R%d,R%d ", stage->opcode, stage->rs1, stage->rs2, stage->rs3);
+  fprintf(cpu->out, "%s", opcode_info[stage->opcode].name);
+  if (flags & OPF_RD) {
+    fprintf(cpu->out, ",R%d", APEX_rd(ins));
   }
-
-   if (strcmp(stage->opcode, "LDR") == 0) {
-    printf(
-      "%s,R%d,R%d,R%d ", stage->opcode, stage->rs1, stage->rs2, stage->rs2);
+  if (flags & OPF_RS1) {
+    fprintf(cpu->out, ",R%d", APEX_rs1(ins));
   }
-  */
-
-  if (strcmp(stage->opcode, "MOVC") == 0) {
-    printf("%s,R%d,#%d ", stage->opcode, stage->rd, stage->imm);
+  if (flags & OPF_RS2) {
+    fprintf(cpu->out, ",R%d", APEX_rs2(ins));
   }
-   if (strcmp(stage->opcode, "ADD") == 0) {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+  if (flags & OPF_IMM) {
+    fprintf(cpu->out, ",#%d", APEX_imm(ins));
   }
-
-   if (strcmp(stage->opcode, "ADDL") == 0) {
-    printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
+  if (flags & (OPF_RD | OPF_RS1 | OPF_RS2)) {
+    fprintf(cpu->out, " ");
   }
+}
 
-   if (strcmp(stage->opcode, "SUB") == 0) {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
-  }
-  if (strcmp(stage->opcode, "SUBL") == 0) {
-    printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
-  }
+/* Debug function which dumps the cpu stage
+ * content
+ *
+ * Note : You are not supposed to edit this function
+ *
+ */
+static void
+print_stage_content(APEX_CPU* cpu, const char* name, CPU_Stage* stage)
+{
+  fprintf(cpu->out, "%-15s: pc(%d) ", name, stage->pc);
+  print_instruction(cpu, stage);
+  fprintf(cpu->out, "\n");
+}
 
-   if (strcmp(stage->opcode, "AND") == 0) {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
-  }
+/*
+ * Prints the content of a latch as shown by the stage working on latch id
+ */
+void
+APEX_print_stage(APEX_CPU* cpu, int id, CPU_Stage* stage)
+{
+  print_stage_content(cpu, cpu->stage_name[id], stage);
+}
+
+/*
+ * Prints the content of a latch under any name
+ */
+void
+APEX_print_latch(APEX_CPU* cpu, const char* name, CPU_Stage* stage)
+{
+  print_stage_content(cpu, name, stage);
+}
 
-  if (strcmp(stage->opcode, "OR") == 0) {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+/* Shows the latch a stage has worked on in this cycle, printing it and
+ * recording it in the trace. The further latches of a stage that works on
+ * several are not shown.
+ */
+static inline void
+show_stage(APEX_CPU* cpu, int id, CPU_Stage* stage)
+{
+  if (!cpu->stage_name[id]) {
+    return;
   }
-   if (strcmp(stage->opcode, "EX-OR") == 0) {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+  if (cpu->verbosity >= APEX_VERBOSITY_STAGE) {
+    print_stage_content(cpu, cpu->stage_name[id], stage);
   }
-
-  if (strcmp(stage->opcode, "LOAD") == 0) {
-    printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rs1, stage->rs2, stage->imm);
+  if (cpu->trace) {
+    APEX_trace_stage(cpu->trace, id, stage);
   }
+}
 
-   if (strcmp(stage->opcode, "MUL") == 0) {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+/* Shows the latch group of a stage: slot 0 as a single latch, the other
+ * slots only while they hold an instruction. Traces are of width 1.
+ */
+static inline void
+show_group(APEX_CPU* cpu, int id, CPU_Stage* group)
+{
+  show_stage(cpu, id, group);
+  for (int k = 1; k < APEX_width(cpu) && cpu->verbosity >= APEX_VERBOSITY_STAGE &&
+                  cpu->stage_name[id];
+       ++k) {
+    if (group[k].pc != 0) {
+      print_stage_content(cpu, cpu->stage_name[id], &group[k]);
+    }
   }
+}
 
-  if (strcmp(stage->opcode, "BZ") == 0) {
-    printf("%s,#%d", stage->opcode, stage->imm);
-  }
-   if (strcmp(stage->opcode, "BNZ") == 0) {
-    printf("%s,#%d", stage->opcode, stage->imm);
-  }
+/* Per-opcode work of one pipeline stage. Every stage owns a table indexed by
+ * OPCODE_*, a NULL entry means the opcode does nothing in that stage.
+ */
+typedef void (*APEX_Stage_Handler)(APEX_CPU* cpu, CPU_Stage* stage);
 
-  if (strcmp(stage->opcode, "NOP") == 0) {
-    printf("NOP");
+static inline void
+dispatch(const APEX_Stage_Handler* table, APEX_CPU* cpu, CPU_Stage* stage)
+{
+  APEX_Stage_Handler handler = table[stage->opcode];
+  if (handler) {
+    handler(cpu, stage);
   }
+}
 
-  if (strcmp(stage->opcode, "HALT\n") == 0) {
-    printf("HALT");
+/* Runs the handlers of a latch group in slot order, oldest first */
+static inline void
+dispatch_group(const APEX_Stage_Handler* table, APEX_CPU* cpu,
+               CPU_Stage* group)
+{
+  for (int k = 0; k < APEX_width(cpu); ++k) {
+    dispatch(table, cpu, &group[k]);
   }
 }
 
-/* Debug function which dumps the cpu stage
- * content
- *
- * Note : You are not supposed to edit this function
- *
+/* Replaces the content of a latch with a bubble. Nothing of the previous
+ * content is kept, so that a drained pipeline stays exactly as it is.
  */
-static void
-print_stage_content(char* name, CPU_Stage* stage)
+static inline void
+insert_nop(CPU_Stage* stage)
 {
-  printf("%-15s: pc(%d) ", name, stage->pc);
-  print_instruction(stage);
-  printf("\n");
+  memset(stage, 0, sizeof(*stage));
+  stage->opcode = OPCODE_NOP;
 }
 
-/*
- *  Fetch Stage of APEX Pipeline
- *
- *  Note : You are free to edit this function according to your
- * 				 implementation
- */
-int
-fetch(APEX_CPU* cpu,const char* command)
+/* Replaces every slot of the latch group of stage id with a bubble */
+static inline void
+insert_bubble(APEX_CPU* cpu, int id)
 {
-  CPU_Stage* stage = &cpu->stage[F];
-/*  if(jflag==1){
-    cpu->pc=nextAddress;
+  for (int k = 0; k < APEX_width(cpu); ++k) {
+    insert_nop(&cpu->stage[id][k]);
   }
-  */
+}
 
-  if (!stage->busy && !stage->stalled) {  
-    /* Store current PC in fetch latch */
-    stage->pc = cpu->pc;
+/* Moves the group in latch from into the latch after it by exchanging the
+ * latch pointers, leaving a bubble behind in latch from
+ */
+static inline void
+advance(APEX_CPU* cpu, int from)
+{
+  int to = cpu->next[from];
+  CPU_Stage* moved = cpu->stage[from];
+  cpu->stage[from] = cpu->stage[to];
+  cpu->stage[to] = moved;
+  insert_bubble(cpu, from);
+}
 
-    /* Index into code memory using this pc and copy all instruction fields into
-     * fetch latch
-     */
-    APEX_Instruction* current_ins = &cpu->code_memory[get_code_index(cpu->pc)];
-    strcpy(stage->opcode, current_ins->opcode);
-    stage->rd = current_ins->rd;
-    stage->rs1 = current_ins->rs1;
-    stage->rs2 = current_ins->rs2;
-    stage->imm = current_ins->imm;
-    stage->rd = current_ins->rd;
-
-    if(cpu->stage[DRF].stalled==0)
-    {
-    /* Update PC for next instruction */
-    cpu->pc += 4;
-    /* Copy data from fetch latch to decode latch*/
-    cpu->stage[DRF] = cpu->stage[F];
-  }
-
-    if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Fetch", stage);
-    }
+/* Fetch: moves the fetch buffer up to pc and runs the instruction cache
+ * behind it for a cycle, returning how many instructions from pc on are
+ * buffered. Once fetch has left the buffer it restarts at pc, dropping the
+ * line in flight. The cache fills one line at a time, from the first
+ * instruction missing up to the end of its line, as far as it fits.
+ */
+static int
+fill_fetch_buffer(APEX_CPU* cpu)
+{
+  int pc = cpu->pc;
+  if (pc < cpu->buffer_pc || pc > cpu->buffer_pc + 4 * cpu->buffer_count) {
+    cpu->buffer_count = 0;
+    cpu->fetch_wait = 0;
+  } else {
+    cpu->buffer_count -= (pc - cpu->buffer_pc) / 4;
+  }
+  cpu->buffer_pc = pc;
+
+  int next = get_code_index(pc) + cpu->buffer_count;
+  int arrived = 0;
+  if (cpu->fetch_wait > 0) {
+    arrived = --cpu->fetch_wait == 0;
+  } else if (cpu->buffer_count < cpu->fetch_buffer_size &&
+             next < cpu->code_memory_size) {
+    cpu->fetch_wait =
+      APEX_cache_access(cpu->icache, cpu->counters.icache, next, 0) - 1;
+    arrived = cpu->fetch_wait == 0;
   }
-   
-  else{
-       CPU_Stage nop;
-          memset(&nop, 0, sizeof(nop));
-          memcpy(&nop.opcode, "NOP", 3);
-          cpu->stage[DRF] = nop;
-
-      //strcpy(cpu->stage[DRF].opcode, "NOP");
 
-     
+  if (arrived) {
+    int line = cpu->icache->config.line;
+    int words = line - next % line;
+    if (words > cpu->fetch_buffer_size - cpu->buffer_count) {
+      words = cpu->fetch_buffer_size - cpu->buffer_count;
     }
-  return 0;
+    if (words > cpu->code_memory_size - next) {
+      words = cpu->code_memory_size - next;
+    }
+    cpu->buffer_count += words;
+  }
+  return cpu->buffer_count;
 }
 
 /*
- *  Decode Stage of APEX Pipeline
+ *  Fetch Stage of APEX Pipeline
  *
  *  Note : You are free to edit this function according to your
  * 				 implementation
  */
 int
-decode(APEX_CPU* cpu, const char* command)
+fetch(APEX_CPU* cpu)
 {
-  CPU_Stage* stage = &cpu->stage[DRF];
-
-   // printf("opcode print %s", cpu->stage[EX1].opcode);
-
-    /* Read data from register file for store */
-    if (strcmp(stage->opcode, "STORE") == 0) {
-
-      if(cpu->regs_valid[stage->rs1]==0||cpu->regs_valid[stage->rs2]==0){
-      stage->stalled=1;
-    }
-    else {
-      stage->stalled=0;
-      stage->rs1_value=cpu->regs[stage->rs1];
-      stage->rs2_value=cpu->regs[stage->rs2];
-      //cpu->stage[EX1]=cpu->stage[DRF];
-    }
+  CPU_Stage* group = cpu->stage[F];
+  int pc = cpu->pc;
+  int index = get_code_index(pc);
+  int can_fetch = !group->busy && !group->stalled && index >= 0 &&
+                  index < cpu->code_memory_size;
+  int available = APEX_width(cpu);
+
+  /* With an instruction cache, fetch takes what the fetch buffer holds */
+  if (can_fetch && cpu->icache) {
+    available = fill_fetch_buffer(cpu);
+    if (available == 0) {
+      cpu->counters.stalls[APEX_STALL_ICACHE]++;
+      can_fetch = 0;
     }
-    
-    /*
-
-     if (strcmp(stage->opcode, "STR") == 0) {
+  }
 
-      if(cpu->regs_valid[stage->rs2]==0||cpu->regs_valid[stage->rs3]==0){
-      stage->stalled=1;
+  if (can_fetch) {
+    /* Store the PC and the code memory index of each instruction of the
+     * group in its fetch latch, up to the first branch or HALT
+     */
+    int k = 0;
+    int last = 0;
+    while (k < APEX_width(cpu) && k < available && !last &&
+           index < cpu->code_memory_size) {
+      CPU_Stage* stage = &group[k++];
+      stage->pc = pc;
+      stage->index = index;
+      stage->opcode = APEX_opcode(cpu->code_memory[index]);
+      stage->rs1_value = 0;
+      stage->rs2_value = 0;
+      stage->buffer = 0;
+      stage->mem_address = 0;
+      stage->predicted = 0;
+
+      /* PC of the next instruction, as predicted for a branch */
+      if (opcode_info[stage->opcode].flags & OPF_BRANCH) {
+        pc = APEX_predict(cpu, stage);
+        last = 1;
+      } else {
+        pc += 4;
+        last = stage->opcode == OPCODE_HALT;
+      }
+      index = get_code_index(pc);
     }
-    else {
-      stage->stalled=0;
-      stage->rs1_value=cpu->regs[stage->rs1];
-      stage->rs2_value=cpu->regs[stage->rs2];
-      //cpu->stage[EX1]=cpu->stage[DRF];
+    for (; k < APEX_width(cpu); ++k) {
+      insert_nop(&group[k]);
     }
 
+    show_group(cpu, F, group);
 
-
-    }*/
-/*
-    if (strcmp(stage->opcode, "LDR") == 0) {
-
-      if(cpu->regs_valid[stage->rs1]==0||cpu->regs_valid[stage->rs2]==0){
-      stage->stalled=1;
+    if (cpu->stage[cpu->next[F]]->stalled == 0) {
+      /* Move fetch group into decode, or the next fetch stage */
+      cpu->pc = pc;
+      advance(cpu, F);
     }
-    else {
-      stage->stalled=0;
-      stage->rs1_value=cpu->regs[stage->rs1];
-      stage->rs2_value=cpu->regs[stage->rs2];
-      //cpu->stage[EX1]=cpu->stage[DRF];
+  } else {
+    /* Nothing enters decode, whatever it holds stalled stays there */
+    cpu->counters.bubbles[F]++;
+    if (cpu->stage[cpu->next[F]]->stalled == 0) {
+      insert_bubble(cpu, cpu->next[F]);
     }
+  }
+  return 0;
+}
 
+/* Further fetch stage of a deeper pipeline: the group fetched moves on a
+ * stage per cycle, held while the stage after holds its own
+ */
+static int
+fetch_more(APEX_CPU* cpu, int id)
+{
+  CPU_Stage* group = cpu->stage[id];
 
+  group->stalled = cpu->stage[cpu->next[id]]->stalled;
+  if (!group->busy && !group->stalled) {
+    advance(cpu, id);
+  } else if (!group->stalled) {
+    insert_bubble(cpu, cpu->next[id]);
+  }
 
-    }*/
-
-    if (strcmp(stage->opcode, "LOAD") == 0) {
-
-      if(cpu->regs_valid[stage->rs1]==0||cpu->regs_valid[stage->rs2]==0){
-      stage->stalled=1;
-    }
-    else {
-      stage->stalled=0;
-      stage->rs1_value=cpu->regs[stage->rs1];
-
-      //cpu->stage[EX1]=cpu->stage[DRF];
-    }
+  show_group(cpu, id, group);
+  return 0;
+}
 
+int
+fetch2(APEX_CPU* cpu)
+{
+  return fetch_more(cpu, F2);
+}
 
+int
+fetch3(APEX_CPU* cpu)
+{
+  return fetch_more(cpu, F3);
+}
 
-    }
+/* Decode/RF: true if every register the instruction reads is valid and no
+ * older instruction is still to write its destination. LOAD writes back in
+ * MEM2 while ALU results are written in EX2, so a later write to the same
+ * register could otherwise be overtaken.
+ */
+static inline int
+operands_ready(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  APEX_Instruction ins = latch_ins(cpu, stage);
+  int flags = opcode_info[stage->opcode].flags;
+  return (!(flags & OPF_RD) || cpu->regs_valid[APEX_rd(ins)] != 0) &&
+         (!(flags & OPF_RS1) || cpu->regs_valid[APEX_rs1(ins)] != 0) &&
+         (!(flags & OPF_RS2) || cpu->regs_valid[APEX_rs2(ins)] != 0);
+}
 
-    /* No Register file read needed for MOVC */
-    if (strcmp(stage->opcode, "MOVC") == 0) 
-    {
+/* Decode/RF: true once the functional units have produced every register
+ * the instruction reads. The result of a unit slower than a cycle reaches
+ * neither the register file nor the forwarding network any earlier.
+ */
+static inline int
+sources_produced(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  APEX_Instruction ins = latch_ins(cpu, stage);
+  int flags = opcode_info[stage->opcode].flags;
+  return (!(flags & OPF_RS1) || cpu->clock >= cpu->reg_ready[APEX_rs1(ins)]) &&
+         (!(flags & OPF_RS2) || cpu->clock >= cpu->reg_ready[APEX_rs2(ins)]);
+}
 
+/* Decode/RF with forwarding: the youngest instruction past decode that is
+ * still to write reg and the stage whose latch holds it, NULL if the
+ * register file already has its value. ALU results are written in EX2, so
+ * only the latch EX1 has just filled can hold a pending one.
+ */
+static CPU_Stage*
+pending_writer(APEX_CPU* cpu, int reg, int* position)
+{
+  for (int i = EX2; i <= MEM2; ++i) {
+    for (int k = APEX_width(cpu) - 1; k >= 0; --k) {
+      CPU_Stage* writer = &cpu->stage[i][k];
+      int flags = opcode_info[writer->opcode].flags;
+      if ((flags & OPF_RD) && APEX_rd(latch_ins(cpu, writer)) == reg) {
+        if (!(flags & OPF_MEM) && i != EX2) {
+          return NULL;
+        }
+        *position = i;
+        return writer;
+      }
     }
+  }
+  return NULL;
+}
 
-    if (strcmp(stage->opcode, "BZ") == 0) 
-    {
-
-   // printf("aba\n");
-
+/* Decode/RF with forwarding: reads a source register from the register
+ * file or from the buffer of its pending writer. A loaded value exists
+ * only once MEM1 has run, before that the load-use hazard stalls.
+ */
+static int
+forward_operand(APEX_CPU* cpu, int reg, int* value)
+{
+  int position;
+  CPU_Stage* writer = pending_writer(cpu, reg, &position);
+  if (!writer) {
+    *value = cpu->regs[reg];
+    return 1;
+  }
 
-      if(strcmp(cpu->stage[EX1].opcode, "SUB")==0 || strcmp(cpu->stage[EX1].opcode, "MUL")==0 || strcmp(cpu->stage[EX1].opcode, "ADD")==0  ){
-       ptr=0;
-       //printf("inside conditin");
-      }
+  int load = opcode_info[writer->opcode].flags & OPF_MEM;
+  if (!(APEX_forwarding(cpu) & (load ? APEX_FORWARD_LOAD : APEX_FORWARD_ALU)) ||
+      (load && position != MEM2)) {
+    return 0;
+  }
+  *value = writer->buffer;
+  return 1;
+}
 
-      if(ptr!=2 && ptr>=0){
-        stage->stalled=1;
-        ptr +=1;
-      }
-      if(ptr==2){
-        stage->stalled=0;
-      }
+/* Decode/RF with forwarding: true once every source is available. An ALU
+ * result must still not be written ahead of an older LOAD to the same
+ * register, which happens only with the LOAD right in front.
+ */
+static int
+forward_operands(APEX_CPU* cpu, CPU_Stage* stage, int* rs1_value,
+                 int* rs2_value)
+{
+  APEX_Instruction ins = latch_ins(cpu, stage);
+  int flags = opcode_info[stage->opcode].flags;
+  int position;
 
+  if ((flags & OPF_RD) && !(flags & OPF_MEM)) {
+    CPU_Stage* writer = pending_writer(cpu, APEX_rd(ins), &position);
+    if (writer && position == EX2 &&
+        (opcode_info[writer->opcode].flags & OPF_MEM)) {
+      return 0;
     }
+  }
+  return (!(flags & OPF_RS1) ||
+          forward_operand(cpu, APEX_rs1(ins), rs1_value)) &&
+         (!(flags & OPF_RS2) ||
+          forward_operand(cpu, APEX_rs2(ins), rs2_value));
+}
 
+/* Decode/RF: true once the source operands are valid or can be forwarded,
+ * reading them into rs1_value and rs2_value
+ */
+static int
+sources_ready(APEX_CPU* cpu, CPU_Stage* stage, int* rs1_value, int* rs2_value)
+{
+  APEX_Instruction ins = latch_ins(cpu, stage);
+  *rs1_value = cpu->regs[APEX_rs1(ins)];
+  *rs2_value = cpu->regs[APEX_rs2(ins)];
+
+  return sources_produced(cpu, stage) &&
+         (APEX_forwarding(cpu)
+            ? forward_operands(cpu, stage, rs1_value, rs2_value)
+            : operands_ready(cpu, stage));
+}
 
-  if (strcmp(stage->opcode, "BNZ") == 0) 
-    {
-
-   // printf("aba\n");
-
+/* Decode/RF: reads the source operands, stalling until they are valid or
+ * can be forwarded. A literal takes the place of the second source.
+ */
+static void
+decode_read_sources(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  APEX_Instruction ins = latch_ins(cpu, stage);
+  int rs1_value;
+  int rs2_value;
+
+  if (!sources_ready(cpu, stage, &rs1_value, &rs2_value)) {
+    stage->stalled = 1;
+    cpu->counters.stalls[APEX_STALL_RAW]++;
+    return;
+  }
+  if (APEX_forwarding(cpu) && !operands_ready(cpu, stage)) {
+    cpu->counters.forwarded++;
+  }
 
-      if(strcmp(cpu->stage[EX1].opcode, "SUB")==0 || strcmp(cpu->stage[EX1].opcode, "MUL")==0 || strcmp(cpu->stage[EX1].opcode, "ADD")==0  ){
-       ptr=0;
-       //printf("inside conditin");
-      }
+  stage->stalled = 0;
+  stage->rs1_value = rs1_value;
+  if (opcode_info[stage->opcode].flags & OPF_RS2) {
+    stage->rs2_value = rs2_value;
+  } else if (opcode_info[stage->opcode].flags & OPF_IMM) {
+    stage->rs2_value = APEX_imm(ins);
+  }
+}
 
-      if(ptr!=2 && ptr>=0){
-        stage->stalled=1;
-        ptr +=1;
-      }
-      if(ptr==2){
-        stage->stalled=0;
+/* Decode/RF: BZ and BNZ wait two cycles behind a zero flag producer that
+ * has just left EX1 for EX2 in this cycle. Predicted branches do not wait,
+ * the zero flag is always produced by the time they reach EX2 unless its
+ * producer has a slower unit.
+ */
+static void
+decode_branch(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  if (APEX_prediction(cpu) == APEX_PREDICT_NONE) {
+    for (int k = 0; k < APEX_width(cpu); ++k) {
+      if (opcode_info[cpu->stage[EX2][k].opcode].flags & OPF_SETS_ZF) {
+        cpu->branch_wait = 0;
       }
-
     }
 
-
-
-    
-
-    if (strcmp(stage->opcode, "HALT\n") == 0) 
-    {
-        cpu->stage[F].busy=1;
+    if (cpu->branch_wait != 2 && cpu->branch_wait >= 0) {
+      stage->stalled = 1;
+      cpu->branch_wait += 1;
     }
-
-    if (strcmp(stage->opcode, "ADD") == 0){
-      //printf("regs valid %d\n",cpu->regs_valid[stage->rs1]);
-
-    if(cpu->regs_valid[stage->rs1]==0||cpu->regs_valid[stage->rs2]==0){
-      stage->stalled=1;
-      //printf("Drf for add stall %d",  stage->stalled);
-
+    if (cpu->branch_wait == 2) {
+      stage->stalled = 0;
     }
+  }
+  if (cpu->clock < cpu->zero_flag_ready) {
+    stage->stalled = 1;
+  }
+  if (stage->stalled) {
+    cpu->counters.stalls[APEX_STALL_BRANCH]++;
+  }
+}
 
-   
-      else {
-      //  printf("going inside else");
-      stage->stalled=0;
-      stage->rs1_value=cpu->regs[stage->rs1];
-      stage->rs2_value=cpu->regs[stage->rs2];
-      //cpu->stage[EX1]=cpu->stage[DRF];
-    }
-   }
-
-    if (strcmp(stage->opcode, "SUB") == 0){
-    if(cpu->regs_valid[stage->rs1]==0||cpu->regs_valid[stage->rs2]==0){
-      stage->stalled=1;
-      
+/* Decode/RF: HALT stops any further fetch, dropping what further fetch
+ * stages have brought in after it
+ */
+static void
+decode_halt(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  (void)stage;
+  cpu->stage[F]->busy = 1;
+  for (int id = cpu->next[F]; id != DRF; id = cpu->next[id]) {
+    insert_bubble(cpu, id);
+  }
+}
 
+static const APEX_Stage_Handler decode_table[NUM_OPCODES] = {
+  [OPCODE_MOVC] = decode_read_sources,
+  [OPCODE_ADD] = decode_read_sources,   [OPCODE_ADDL] = decode_read_sources,
+  [OPCODE_SUB] = decode_read_sources,   [OPCODE_SUBL] = decode_read_sources,
+  [OPCODE_MUL] = decode_read_sources,   [OPCODE_AND] = decode_read_sources,
+  [OPCODE_OR] = decode_read_sources,    [OPCODE_EXOR] = decode_read_sources,
+  [OPCODE_LOAD] = decode_read_sources,  [OPCODE_STORE] = decode_read_sources,
+  [OPCODE_BZ] = decode_branch,          [OPCODE_BNZ] = decode_branch,
+  [OPCODE_HALT] = decode_halt,
+};
+
+/* Number of instructions of a group each functional unit accepts per cycle.
+ * An iterative unit takes only one.
+ */
+static const int unit_limit[APEX_NUM_UNITS] = {
+  [APEX_UNIT_ALU] = APEX_MAX_WIDTH,
+  [APEX_UNIT_MUL] = APEX_MUL_UNITS,
+  [APEX_UNIT_MEM] = APEX_MEM_PORTS,
+  [APEX_UNIT_BRANCH] = APEX_MAX_WIDTH,
+};
+
+/* Decode/RF: the stall cause keeping slot of the decode group from issuing
+ * together with the older slots, -1 if there is none. Its unit must accept
+ * it in the next cycle, when it reaches EX1. An older slot has not reached
+ * EX1 yet, so neither the register file nor the forwarding network knows it
+ * writes its destination; without a predictor a BZ/BNZ must also see its
+ * zero flag producer reach EX2 first.
+ */
+static int
+group_hazard(APEX_CPU* cpu, CPU_Stage* group, int slot, const int* units)
+{
+  CPU_Stage* stage = &group[slot];
+  APEX_Instruction ins = latch_ins(cpu, stage);
+  int flags = opcode_info[stage->opcode].flags;
+  int unit = APEX_unit(stage->opcode);
+
+  if (units[unit] == unit_limit[unit] ||
+      (units[unit] > 0 && APEX_unit_timing(cpu, unit)->interval > 1) ||
+      cpu->clock + 1 < cpu->unit_free[unit]) {
+    return APEX_STALL_UNIT;
+  }
+  for (int k = 0; k < slot; ++k) {
+    int older = opcode_info[group[k].opcode].flags;
+    int rd = APEX_rd(latch_ins(cpu, &group[k]));
+    if ((older & OPF_RD) &&
+        (((flags & OPF_RD) && APEX_rd(ins) == rd) ||
+         ((flags & OPF_RS1) && APEX_rs1(ins) == rd) ||
+         ((flags & OPF_RS2) && APEX_rs2(ins) == rd))) {
+      return APEX_STALL_RAW;
+    }
+    if ((older & OPF_SETS_ZF) && (flags & OPF_BRANCH) &&
+        APEX_prediction(cpu) == APEX_PREDICT_NONE) {
+      return APEX_STALL_BRANCH;
     }
+  }
+  return -1;
+}
 
-    else {
-      stage->stalled=0;
-      stage->rs1_value=cpu->regs[stage->rs1];
-      stage->rs2_value=cpu->regs[stage->rs2];
-      }
-   }
-
-   if (strcmp(stage->opcode, "OR") == 0) {
-  stage->rs1_value=cpu->regs[stage->rs1];
-  stage->rs2_value=cpu->regs[stage->rs2];
- // cpu->regs_valid[stage->rd] = 0;
-    }
-  if (strcmp(stage->opcode, "EX-OR") == 0) {
-  stage->rs1_value=cpu->regs[stage->rs1];
-  stage->rs2_value=cpu->regs[stage->rs2];
- // cpu->regs_valid[stage->rd] = 0;
-    }
+/* Decode/RF: moves the first count slots of the decode group into EX1 and
+ * the rest to the front of the decode group, where they wait stalled
+ */
+static void
+issue_partial(APEX_CPU* cpu, int count)
+{
+  CPU_Stage* group = cpu->stage[DRF];
+  cpu->stage[DRF] = cpu->stage[EX1];
+  cpu->stage[EX1] = group;
+  insert_bubble(cpu, DRF);
+  memcpy(cpu->stage[DRF], &group[count],
+         sizeof(*group) * (APEX_width(cpu) - count));
+  for (int k = count; k < APEX_width(cpu); ++k) {
+    insert_nop(&group[k]);
+  }
+}
 
-    if (strcmp(stage->opcode, "ADDL") == 0){
-    if(cpu->regs_valid[stage->rs1]==0||cpu->regs_valid[stage->rs2]==0){
-      stage->stalled=1;
-      
+/*
+ *  Decode Stage of APEX Pipeline
+ *
+ *  Note : You are free to edit this function according to your
+ * 				 implementation
+ */
+int
+decode(APEX_CPU* cpu)
+{
+  CPU_Stage* group = cpu->stage[DRF];
+  int units[APEX_NUM_UNITS] = { 0 };
+  int count = 0;
+  int issued = 0;
 
-    }
+  while (count < APEX_width(cpu) && group[count].pc != 0) {
+    count++;
+  }
 
-    else {
-      stage->stalled=0;
-      stage->rs1_value=cpu->regs[stage->rs1];
-      stage->rs2_value=cpu->regs[stage->imm];
-      }
-   }
+  /* A group held in EX1 keeps this one in decode */
+  if (cpu->stage[EX1]->stalled && cpu->stage[EX1]->pc != 0) {
+    group->stalled = count > 0;
+    show_group(cpu, DRF, group);
+    return 0;
+  }
 
-    if (strcmp(stage->opcode, "SUBL") == 0){
-    if(cpu->regs_valid[stage->rs1]==0||cpu->regs_valid[stage->rs2]==0){
-      stage->stalled=1;
-      
+  /* Slots issue in order, up to the first one that cannot */
+  for (; issued < count; ++issued) {
+    CPU_Stage* stage = &group[issued];
+    int cause = group_hazard(cpu, group, issued, units);
+    if (cause >= 0) {
+      stage->stalled = 1;
+      cpu->counters.stalls[cause]++;
+      break;
+    }
 
+    stage->stalled = 0;
+    dispatch(decode_table, cpu, stage);
+    if (stage->stalled) {
+      break;
     }
+    units[APEX_unit(stage->opcode)]++;
+  }
 
-    else {
-      stage->stalled=0;
-      stage->rs1_value=cpu->regs[stage->rs1];
-      stage->rs2_value=cpu->regs[stage->imm];
-      }
-   }
+  show_group(cpu, DRF, group);
 
+  /* Move decode group into execute */
+  if (group->busy == 0 && issued == count) {
+    advance(cpu, DRF);
+  } else if (group->busy == 0 && issued > 0) {
+    issue_partial(cpu, issued);
+  } else {
+    insert_bubble(cpu, EX1);
+  }
+  return 0;
+}
 
-   if (strcmp(stage->opcode, "MUL") == 0){
-    if(cpu->regs_valid[stage->rs1]==0||cpu->regs_valid[stage->rs2]==0){
-      stage->stalled=1;
-      
+/* EX1: the destination register becomes invalid until it is written */
+static void
+execute1_invalidate_rd(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  APEX_Instruction ins = latch_ins(cpu, stage);
+  cpu->regs_valid[APEX_rd(ins)] = 0;
+}
 
-    }
+/* EX1: ALU operations compute their result into the latch buffer, from
+ * where EX2 writes it back and the forwarding network reads it
+ */
+static void
+execute1_movc(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  execute1_invalidate_rd(cpu, stage);
+  stage->buffer = APEX_imm(latch_ins(cpu, stage));
+}
 
-    else {
-      stage->stalled=0;
-      stage->rs1_value=cpu->regs[stage->rs1];
-      stage->rs2_value=cpu->regs[stage->rs2];
-      }
-   }
+static void
+execute1_add(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  execute1_invalidate_rd(cpu, stage);
+  stage->buffer = stage->rs1_value + stage->rs2_value;
+}
 
-    if (strcmp(stage->opcode, "AND") == 0){
-    if(cpu->regs_valid[stage->rs1]==0||cpu->regs_valid[stage->rs2]==0){
-      stage->stalled=1;
-      
+static void
+execute1_sub(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  execute1_invalidate_rd(cpu, stage);
+  stage->buffer = stage->rs1_value - stage->rs2_value;
+}
 
-    }
+static void
+execute1_mul(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  execute1_invalidate_rd(cpu, stage);
+  stage->buffer = stage->rs1_value * stage->rs2_value;
+}
 
-    else {
-      stage->stalled=0;
-      stage->rs1_value=cpu->regs[stage->rs1];
-      stage->rs2_value=cpu->regs[stage->rs2];
-      }
-   }
+static void
+execute1_and(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  execute1_invalidate_rd(cpu, stage);
+  stage->buffer = stage->rs1_value & stage->rs2_value;
+}
 
+static void
+execute1_or(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  execute1_invalidate_rd(cpu, stage);
+  stage->buffer = stage->rs1_value | stage->rs2_value;
+}
 
+static void
+execute1_exor(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  execute1_invalidate_rd(cpu, stage);
+  stage->buffer = stage->rs1_value ^ stage->rs2_value;
+}
 
+static const APEX_Stage_Handler execute1_table[NUM_OPCODES] = {
+  [OPCODE_MOVC] = execute1_movc, [OPCODE_ADD] = execute1_add,
+  [OPCODE_ADDL] = execute1_add,  [OPCODE_SUB] = execute1_sub,
+  [OPCODE_SUBL] = execute1_sub,  [OPCODE_MUL] = execute1_mul,
+  [OPCODE_AND] = execute1_and,   [OPCODE_OR] = execute1_or,
+  [OPCODE_EXOR] = execute1_exor, [OPCODE_LOAD] = execute1_invalidate_rd,
+};
+
+/* EX1: the group starts on its functional units. Results of an ALU or
+ * multiplier are due after the unit's latency while the group moves on; a
+ * memory or branch unit hands its result to the next stage, so the group
+ * stays in EX1 for the returned number of extra cycles.
+ */
+static int
+start_units(APEX_CPU* cpu, CPU_Stage* group)
+{
+  int wait = 0;
 
+  for (int k = 0; k < APEX_width(cpu); ++k) {
+    CPU_Stage* stage = &group[k];
+    if (stage->pc == 0 || stage->opcode == OPCODE_NOP) {
+      continue;
+    }
+    int unit = APEX_unit(stage->opcode);
+    const APEX_Unit_Config* config = APEX_unit_timing(cpu, unit);
+    int flags = opcode_info[stage->opcode].flags;
 
+    int latency = config->latency;
 
-    /* Copy data from decode latch to execute latch*/
-    if(stage->stalled==0 && stage->busy==0){
-      cpu->stage[EX1]=cpu->stage[DRF];
+    cpu->unit_free[unit] = cpu->clock + config->interval;
+    if (unit == APEX_UNIT_MEM || unit == APEX_UNIT_BRANCH) {
+      wait = latency - 1 > wait ? latency - 1 : wait;
+      latency = 1;
     }
-    else{ CPU_Stage nop;
-          memset(&nop, 0, sizeof(nop));
-          memcpy(&nop.opcode, "NOP", 3);
-      cpu->stage[EX1]=nop;
-
-     
+    if (flags & OPF_RD) {
+      cpu->reg_ready[APEX_rd(latch_ins(cpu, stage))] = cpu->clock + latency;
     }
-
-    if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Decode/RF", stage);
+    if (flags & OPF_SETS_ZF) {
+      cpu->zero_flag_ready = cpu->clock + latency - 1;
     }
-  
-  return 0;
+  }
+  return wait;
 }
 
 /*
@@ -514,307 +1029,284 @@ decode(APEX_CPU* cpu, const char* command)
  * 				 implementation
  */
 int
-execute1(APEX_CPU* cpu,const char* command)
+execute1(APEX_CPU* cpu)
 {
-  CPU_Stage* stage = &cpu->stage[EX1];
-  if(cpu->stage[DRF].stalled==1)
-  {
-    stage->stalled=1;
+  CPU_Stage* stage = cpu->stage[EX1];
+  int held = cpu->stage[EX2]->stalled ||
+             (cpu->stage[DRF]->stalled == 1 && stage->pc == 0);
+
+  if (!stage->busy && cpu->ex_wait < 0 && !held) {
+    dispatch_group(execute1_table, cpu, stage);
+    cpu->ex_wait = start_units(cpu, stage);
+  } else if (cpu->ex_wait > 0) {
+    cpu->ex_wait--;
   }
+  stage->stalled = held || cpu->ex_wait > 0;
 
   if (!stage->busy && !stage->stalled) {
-
-    /* Store */
-    if (strcmp(stage->opcode, "STORE") == 0) {
-    }
-
-    /* MOVC */
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-       cpu->regs_valid[stage->rd] = 0;
-    }
-
-    if (strcmp(stage->opcode, "SUBL") == 0) {
-   
-    /* Making it Invalid */
-    cpu->regs_valid[stage->rd] = 0;
-    }
-
-    if (strcmp(stage->opcode, "ADDL") == 0) {
-   
-    /* Making it Invalid */
-    cpu->regs_valid[stage->rd] = 0;
-    }
-
-     if (strcmp(stage->opcode, "ADD") == 0) {
-   
-    /* Making it Invalid */
-    cpu->regs_valid[stage->rd] = 0;
-    }
-
-
-    if (strcmp(stage->opcode, "AND") == 0) {
-    cpu->regs_valid[stage->rd] = 0;
-    }
-
-    if (strcmp(stage->opcode, "OR") == 0) {
-    cpu->regs_valid[stage->rd] = 0;
-    }
-
-    if (strcmp(stage->opcode, "EX-OR") == 0) {
-    cpu->regs_valid[stage->rd] = 0;
-    }
-
-    if (strcmp(stage->opcode, "MUL") == 0) {
-    cpu->regs_valid[stage->rd] = 0;
-    }
-
-
-    if (strcmp(stage->opcode, "SUB") == 0) {
-    
-    /* Making Invalid */
-    cpu->regs_valid[stage->rd] = 0;
-    }
-/*
-     if (strcmp(stage->opcode, "STR") == 0) {
-      cpu->regs[stage->rd] = stage->buffer;
-      cpu->regs_valid[stage->rs1] = 1;
-    }
-    */
-
-
-
-    /* Copy data from Execute latch to Memory latch*/
-    cpu->stage[EX2] = cpu->stage[EX1];
-
-    if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Execute1", stage);
-    }
+    advance(cpu, EX1);
+    cpu->ex_wait = -1;
+  } else if (!cpu->stage[EX2]->stalled) {
+    insert_bubble(cpu, EX2);
   }
 
-  else{
-     CPU_Stage nop;
-          memset(&nop, 0, sizeof(nop));
-          memcpy(&nop.opcode, "NOP", 3);
-          cpu->stage[EX2] = nop;
-   // strcpy(cpu->stage[EX2].opcode, "NOP");
-
-     if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Execute1", stage);
-    }
-  }
+  show_group(cpu, EX1, stage);
   return 0;
 }
 
-int
-execute2(APEX_CPU* cpu,const char* command)
+/* EX2: commits the result computed into the latch buffer to rd, updating
+ * the zero flag for ADD, SUB and MUL
+ */
+static void
+execute2_write_rd(APEX_CPU* cpu, CPU_Stage* stage)
 {
-  CPU_Stage* stage = &cpu->stage[EX2];
+  APEX_Instruction ins = latch_ins(cpu, stage);
 
-  
-  
-  if(cpu->stage[EX1].stalled==1)
-  {
-    stage->stalled=1;
+  cpu->regs[APEX_rd(ins)] = stage->buffer;
+  cpu->regs_valid[APEX_rd(ins)] = 1;
+  if (opcode_info[stage->opcode].flags & OPF_SETS_ZF) {
+    cpu->zero_flag = (stage->buffer == 0);
   }
+}
 
-  if (!stage->busy && !stage->stalled) {
-
-     if (strcmp(stage->opcode, "ADD") == 0) {
-    
-       cpu->regs[stage->rd] = stage->buffer;
-      
-      cpu->regs_valid[stage->rd] = 1;
-    if(cpu->regs[stage->rd] == 0){
-      zeroFlag=1;
-      }
-    else if(cpu->regs[stage->rd] != 0){
-    zeroFlag=0;
-    }
-    // printf("\nregister valid in wb after updating it to 1 %d\n", cpu->regs_valid[stage->rd]);
-    
-    }
-
-
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-      cpu->regs[stage->rd] = stage->buffer;
-       cpu->regs_valid[stage->rd] = 1;
-    }
-
-    if (strcmp(stage->opcode, "SUBL") == 0) {
-      cpu->regs[stage->rd] = stage->buffer;
-   cpu->regs_valid[stage->rd] = 1;
-    }
-
-
-     if (strcmp(stage->opcode, "ADDL") == 0) {
-      cpu->regs[stage->rd] = stage->buffer;
-      cpu->regs_valid[stage->rd] = 1;
-    }
-
-
-    if (strcmp(stage->opcode, "OR") == 0) {
-      cpu->regs[stage->rd] = stage->buffer;
-      cpu->regs_valid[stage->rd] = 1;
-    }
-
-     if (strcmp(stage->opcode, "AND") == 0) {
-      cpu->regs[stage->rd] = stage->buffer;
-      cpu->regs_valid[stage->rd] = 1;
-    }
-
-  
-
-
-    if (strcmp(stage->opcode, "SUB") == 0) {
-      cpu->regs[stage->rd] = stage->buffer;
-    cpu->regs_valid[stage->rd] = 1;
-
-    if(cpu->regs[stage->rd] == 0){
-      zeroFlag=1;
-      }
-    else if(cpu->regs[stage->rd] != 0){
-    zeroFlag=0;
-    }
-    }
-
-
-    if (strcmp(stage->opcode, "MUL") == 0) {
-    cpu->regs[stage->rd] = stage->buffer;
-    cpu->regs_valid[stage->rd] = 1;
-    if(cpu->regs[stage->rd] == 0){
-      zeroFlag=1;
-      }
-    else if(cpu->regs[stage->rd] != 0){
-    zeroFlag=0;
-    }
-    }
-
-    
-  /* EX-OR */
-  if (strcmp(stage->opcode, "EX-OR") == 0) {
-      cpu->regs[stage->rd] = stage->buffer;
-      cpu->regs_valid[stage->rd] = 1;
-    }
-
-
-
-    /* Store */
-    if (strcmp(stage->opcode, "STORE") == 0) {
-      stage->mem_address= stage->rs2_value+stage->imm;
-    }
-/*
-     if (strcmp(stage->opcode, "STR") == 0) {
-
-          stage->buffer= stage->rs2_value+stage->rs1_value;
-           cpu->regs_valid[stage->rd] = 1;
-        
-     
-    }
-     if (strcmp(stage->opcode, "STR") == 0) {
-         cpu->regs[stage->rs1] = stage->buffer;
-    }
-    */
-
-    /* MOVC */
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-      stage->buffer = stage->imm+0;
-
-    }
+static void
+execute2_load(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  stage->mem_address = stage->rs1_value + APEX_imm(latch_ins(cpu, stage));
+}
 
-    if (strcmp(stage->opcode, "BZ") == 0){
+static void
+execute2_store(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  stage->mem_address = stage->rs2_value + APEX_imm(latch_ins(cpu, stage));
+}
 
-     // printf("BF zf");
-      if(zeroFlag==1){
-       // printf("inside zflag ex2");
-         temp=stage->pc+stage->imm;
-        int temp1=temp%4;
-        temp=temp-temp1;
+/* Turns the instructions in the latch group of stage id into NOPs on the
+ * wrong path of a taken branch
+ */
+static inline void
+squash(APEX_CPU* cpu, int id)
+{
+  for (int k = 0; k < APEX_width(cpu); ++k) {
+    CPU_Stage* stage = &cpu->stage[id][k];
+    cpu->counters.penalty++;
+    if (stage->pc != 0 && !stage->squashed) {
+      cpu->counters.flushed++;
+      stage->squashed = 1;
+    }
+    stage->opcode = OPCODE_NOP;
+    stage->stalled = 0;
+  }
+  if (id == EX1 && cpu->ex_wait > 0) {
+    cpu->ex_wait = 0;
+  }
+}
 
-        cpu->pc=temp;
-        strcpy(cpu->stage[DRF].opcode, "NOP");
-                strcpy(cpu->stage[EX1].opcode, "NOP");
-                 // strcpy(cpu->stage[EX2].opcode, "NOP");
-        
-      }
+/* Fetches from the target of a taken branch, squashing what further fetch
+ * stages hold. A HALT decoded behind the branch was on the wrong path, so
+ * fetch resumes.
+ */
+static inline void
+redirect(APEX_CPU* cpu)
+{
+  cpu->pc = cpu->branch_target;
+  cpu->stage[F]->busy = 0;
+  for (int id = cpu->next[F]; id != DRF; id = cpu->next[id]) {
+    squash(cpu, id);
+  }
+}
 
-    }
+/* EX2: BZ is taken on a set zero flag, BNZ on a clear one. Without a
+ * predictor the outcome is kept in the latch buffer for MEM1, with one the
+ * branch only redirects fetch when it was mispredicted.
+ */
+static void
+execute2_branch(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  int taken = (stage->opcode == OPCODE_BZ) ? cpu->zero_flag : !cpu->zero_flag;
+  int target = APEX_branch_target(stage->pc, APEX_imm(latch_ins(cpu, stage)));
+
+  cpu->counters.branches[taken]++;
+  if (APEX_prediction(cpu) == APEX_PREDICT_NONE) {
+    stage->buffer = taken;
+  } else {
+    APEX_predictor_update(cpu, stage, taken, target);
+  }
 
-     if (strcmp(stage->opcode, "BNZ") == 0){
+  if (taken != stage->predicted) {
+    cpu->counters.mispredicts++;
+    cpu->branch_target = taken ? target : stage->pc + 4;
+    redirect(cpu);
+    squash(cpu, DRF);
+    squash(cpu, EX1);
+  }
+}
 
-     // printf("BF zf");
-      if(zeroFlag==0){
-       // printf("inside zflag ex2");
-         temp=stage->pc+stage->imm;
-        int temp1=temp%4;
-        temp=temp-temp1;
+static const APEX_Stage_Handler execute2_table[NUM_OPCODES] = {
+  [OPCODE_MOVC] = execute2_write_rd, [OPCODE_ADD] = execute2_write_rd,
+  [OPCODE_ADDL] = execute2_write_rd, [OPCODE_SUB] = execute2_write_rd,
+  [OPCODE_SUBL] = execute2_write_rd, [OPCODE_MUL] = execute2_write_rd,
+  [OPCODE_AND] = execute2_write_rd,  [OPCODE_OR] = execute2_write_rd,
+  [OPCODE_EXOR] = execute2_write_rd, [OPCODE_LOAD] = execute2_load,
+  [OPCODE_STORE] = execute2_store,   [OPCODE_BZ] = execute2_branch,
+  [OPCODE_BNZ] = execute2_branch,
+};
 
-       /* cpu->pc=temp;
-        strcpy(cpu->stage[DRF].opcode, "NOP");
-                strcpy(cpu->stage[EX1].opcode, "NOP");
-                  strcpy(cpu->stage[EX2].opcode, "NOP");*/
-        
-      }
+int
+execute2(APEX_CPU* cpu)
+{
+  CPU_Stage* stage = cpu->stage[EX2];
 
-    }
+  /* A group held in MEM1 keeps this one in EX2 */
+  stage->stalled = cpu->stage[MEM1]->stalled;
+  if (!stage->busy && !stage->stalled) {
+    dispatch_group(execute2_table, cpu, stage);
+    advance(cpu, EX2);
+  } else if (!stage->stalled) {
+    insert_bubble(cpu, MEM1);
+  }
 
-    if (strcmp(stage->opcode, "ADD") == 0) {
-  stage->buffer= stage->rs1_value + stage->rs2_value;
-    }
+  show_group(cpu, EX2, stage);
+  return 0;
+}
 
-    if (strcmp(stage->opcode, "ADDL") == 0) {
-  stage->buffer= stage->rs1_value + stage->rs2_value;
-    }
-    if (strcmp(stage->opcode, "SUB") == 0) {
-  stage->buffer= stage->rs1_value - stage->rs2_value;
-    }
+/* Execute of the 5-stage pipeline: EX1 and EX2 in one cycle, so that what
+ * holds the group in MEM1 in this cycle holds it in EX1
+ */
+int
+execute(APEX_CPU* cpu)
+{
+  cpu->stage[EX2]->stalled = cpu->stage[MEM1]->stalled;
+  execute1(cpu);
+  return execute2(cpu);
+}
 
-    if (strcmp(stage->opcode, "SUBL") == 0) {
-  stage->buffer= stage->rs1_value - stage->rs2_value;
-    }
+static inline int
+store_queue_enabled(const APEX_CPU* cpu)
+{
+  return cpu->dcache && cpu->store_queue.size > 0;
+}
 
-    if (strcmp(stage->opcode, "AND") == 0) {
-  stage->buffer=stage->rs1_value & stage->rs2_value;
-    }
+static void
+push_store(APEX_Store_Queue* queue, int address)
+{
+  int tail = (queue->head + queue->count++) % APEX_STORE_QUEUE_MAX;
+  queue->address[tail] = address;
+}
 
-    if (strcmp(stage->opcode, "OR") == 0) {
-  stage->buffer=stage->rs1_value | stage->rs2_value;
+/* Whether a queued store has still to write address */
+static int
+store_queued(const APEX_Store_Queue* queue, int address)
+{
+  for (int i = 0; i < queue->count; ++i) {
+    if (queue->address[(queue->head + i) % APEX_STORE_QUEUE_MAX] == address) {
+      return 1;
     }
+  }
+  return 0;
+}
 
-    /* MUL */
-  if (strcmp(stage->opcode, "MUL") == 0) {
-    stage->buffer=stage->rs1_value*stage->rs2_value;
-    }
+/* The oldest queued store starts writing the data cache */
+static void
+start_store_write(APEX_CPU* cpu)
+{
+  APEX_Store_Queue* queue = &cpu->store_queue;
+  queue->wait = APEX_cache_access(cpu->dcache, cpu->counters.dcache,
+                                  queue->address[queue->head], 1);
+}
 
-     if (strcmp(stage->opcode, "EX-OR") == 0) {
-    if (stage->rs1_value == stage->rs2_value){
-      stage->buffer = 0;
-    }else {
-      stage->buffer = 1;
-    } 
+/* Moves the store queue on by a cycle: the oldest store writes the data
+ * cache whenever no load holds the port, and a store waiting in MEM1 takes
+ * the entry it frees
+ */
+static void
+drain_store_queue(APEX_CPU* cpu)
+{
+  APEX_Store_Queue* queue = &cpu->store_queue;
+  if (queue->wait == 0 && queue->count > 0 && !queue->port_taken) {
+    start_store_write(cpu);
+  }
+  if (queue->wait > 0 && --queue->wait == 0) {
+    queue->head = (queue->head + 1) % APEX_STORE_QUEUE_MAX;
+    queue->count--;
+    if (queue->pending) {
+      push_store(queue, queue->pending_address);
+      queue->pending = 0;
     }
+  }
+}
 
+/* MEM1: a data cache holds the group for the latency of its access, the
+ * regular MEM1 cycle included. With a store queue a store only waits for
+ * a free entry, and a load for the cache write in progress unless a queued
+ * store supplies its value.
+ */
+static void
+memory1_store(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  APEX_Store_Queue* queue = &cpu->store_queue;
 
+  APEX_mem_store(cpu, stage->mem_address, stage->rs1_value);
+  if (!cpu->dcache) {
+    return;
+  }
+  if (!store_queue_enabled(cpu)) {
+    cpu->mem_wait =
+      APEX_cache_access(cpu->dcache, cpu->counters.dcache,
+                        stage->mem_address, 1) - 1;
+  } else if (queue->count < queue->size) {
+    push_store(queue, stage->mem_address);
+  } else {
+    if (queue->wait == 0) {
+      start_store_write(cpu);
+    }
+    queue->pending = 1;
+    queue->pending_address = stage->mem_address;
+    cpu->mem_wait = queue->wait - 1;
+  }
+}
 
-    /* Copy data from Execute latch to Memory latch*/
-    cpu->stage[MEM1] = cpu->stage[EX2];
+static void
+memory1_load(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  APEX_Store_Queue* queue = &cpu->store_queue;
 
-    if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Execute2", stage);
-    }
+  stage->buffer = APEX_mem_load(cpu, stage->mem_address);
+  if (!cpu->dcache) {
+    return;
   }
-  else{
-      CPU_Stage nop;
-          memset(&nop, 0, sizeof(nop));
-          memcpy(&nop.opcode, "NOP", 3);
-          cpu->stage[MEM1] = nop;
-   // strcpy(cpu->stage[MEM1].opcode, "NOP");
-     if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Execute2", stage);
-    }
+  if (store_queue_enabled(cpu) && store_queued(queue, stage->mem_address)) {
+    cpu->counters.store_forwarded++;
+    return;
+  }
+  cpu->mem_wait =
+    APEX_cache_access(cpu->dcache, cpu->counters.dcache, stage->mem_address,
+                      0) - 1;
+  if (store_queue_enabled(cpu)) {
+    cpu->mem_wait += queue->wait;
+    queue->port_taken = 1;
   }
-  return 0;
 }
 
+/* MEM1: a taken branch restarts fetch from its target once more */
+static void
+memory1_branch(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  if (stage->buffer) {
+    redirect(cpu);
+    squash(cpu, DRF);
+    squash(cpu, EX1);
+    squash(cpu, EX2);
+  }
+}
+
+static const APEX_Stage_Handler memory1_table[NUM_OPCODES] = {
+  [OPCODE_STORE] = memory1_store,
+  [OPCODE_LOAD] = memory1_load,
+  [OPCODE_BZ] = memory1_branch,
+  [OPCODE_BNZ] = memory1_branch,
+};
+
 /*
  *  Memory Stage of APEX Pipeline
  *
@@ -822,114 +1314,72 @@ execute2(APEX_CPU* cpu,const char* command)
  * 				 implementation
  */
 int
-memory1(APEX_CPU* cpu, const char* command)
-{   
-    
-  CPU_Stage* stage = &cpu->stage[MEM1];
-  if(cpu->stage[EX2].stalled==1)
-  {
-    stage->stalled=1;
-  }
+memory1(APEX_CPU* cpu)
+{
+  CPU_Stage* stage = cpu->stage[MEM1];
 
   if (!stage->busy && !stage->stalled) {
-
-    /* Store */
-    if (strcmp(stage->opcode, "STORE") == 0) {
-          cpu->data_memory[stage->mem_address] = stage->rs1_value;
-    }
-/*
-    if (strcmp(stage->opcode, "STR") == 0) {
-          cpu->data_memory[stage->mem_address] = stage->rs1;
-    }
-    */
-
-    if (strcmp(stage->opcode, "LOAD") == 0) {
-     
-    stage->buffer = cpu->data_memory[stage->mem_address];
-    }
-    
-
-      if (strcmp(stage->opcode, "BZ") == 0) {
-          if(zeroFlag==1){
-              cpu->pc=temp;
-              strcpy(cpu->stage[DRF].opcode, "NOP");
-                strcpy(cpu->stage[EX1].opcode, "NOP");
-                  strcpy(cpu->stage[EX2].opcode, "NOP");
-                    //strcpy(cpu->stage[DRF].opcode, "NOP");
-
-          }
-    }
-
-    /* MOVC */
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-    }
-
-    /* Copy data from decode latch to execute latch*/
-    cpu->stage[MEM2] = cpu->stage[MEM1];
-
-    if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Memory1", stage);
-    }
+    dispatch_group(memory1_table, cpu, stage);
+  } else if (stage->stalled) {
+    cpu->mem_wait--;
+  }
+  stage->stalled = cpu->mem_wait > 0;
+  if (stage->stalled) {
+    cpu->counters.stalls[cpu->store_queue.pending ? APEX_STALL_LSQ
+                                                  : APEX_STALL_DCACHE]++;
+  }
+  if (store_queue_enabled(cpu)) {
+    drain_store_queue(cpu);
+    cpu->store_queue.port_taken &= stage->stalled;
   }
-  else
-  {        CPU_Stage nop;
-          memset(&nop, 0, sizeof(nop));
-          memcpy(&nop.opcode, "NOP", 3);
-          cpu->stage[MEM2] = nop;
-   // strcpy(cpu->stage[MEM2].opcode, "NOP");
-     if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Memory1", stage);
-    }
 
+  if (!stage->busy && !stage->stalled) {
+    advance(cpu, MEM1);
+  } else {
+    insert_bubble(cpu, MEM2);
   }
+
+  show_group(cpu, MEM1, stage);
   return 0;
 }
 
-
-int
-memory2(APEX_CPU* cpu,const char* command)
+static void
+memory2_load(APEX_CPU* cpu, CPU_Stage* stage)
 {
-  CPU_Stage* stage = &cpu->stage[MEM2];
-  if(cpu->stage[MEM1].stalled==1)
-  {
-    stage->stalled=1;
-  }
-
-  if (!stage->busy && !stage->stalled) {
+  APEX_Instruction ins = latch_ins(cpu, stage);
 
-    /* Store */
-    if (strcmp(stage->opcode, "STORE") == 0) {
-     
-    }
-   if (strcmp(stage->opcode, "LOAD") == 0) {
-    cpu->regs[stage->rd] = stage->buffer;
-    cpu->regs_valid[stage->rd] = 1;
-    }
+  cpu->regs[APEX_rd(ins)] = stage->buffer;
+  cpu->regs_valid[APEX_rd(ins)] = 1;
+}
 
-    /* MOVC */
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-    }
+static const APEX_Stage_Handler memory2_table[NUM_OPCODES] = {
+  [OPCODE_LOAD] = memory2_load,
+};
 
-    /* Copy data from decode latch to execute latch*/
-    cpu->stage[WB] = cpu->stage[MEM2];
+int
+memory2(APEX_CPU* cpu)
+{
+  CPU_Stage* stage = cpu->stage[MEM2];
 
-    if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Memory2", stage);
-    }
+  if (!stage->busy && !stage->stalled) {
+    dispatch_group(memory2_table, cpu, stage);
+    advance(cpu, MEM2);
+  } else {
+    insert_bubble(cpu, WB);
   }
-   else
-  {       CPU_Stage nop;
-          memset(&nop, 0, sizeof(nop));
-          memcpy(&nop.opcode, "NOP", 3);
-          cpu->stage[WB] = nop;
-    //strcpy(cpu->stage[WB].opcode, "NOP");
-     if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Memory2", stage);
-    }
 
-  }
+  show_group(cpu, MEM2, stage);
   return 0;
 }
+
+/* Memory of the 5-stage pipeline: MEM1 and MEM2 in one cycle */
+int
+memory(APEX_CPU* cpu)
+{
+  memory1(cpu);
+  return memory2(cpu);
+}
+
 /*
  *  Writeback Stage of APEX Pipeline
  *
@@ -937,36 +1387,17 @@ memory2(APEX_CPU* cpu,const char* command)
  * 				 implementation
  */
 int
-writeback(APEX_CPU* cpu, const char* command)
+writeback(APEX_CPU* cpu)
 {
-  CPU_Stage* stage = &cpu->stage[WB];
+  CPU_Stage* stage = cpu->stage[WB];
   if (!stage->busy && !stage->stalled) {
-
-    /* Update register file */
-    
-
-    
-
-    
-
-   
-
-    
-   
-
-
-    
-    
-  
-
-    if(cpu->stage[WB].pc !=0){
-        cpu->ins_completed++;
+    for (int k = 0; k < APEX_width(cpu); ++k) {
+      if (stage[k].pc != 0 && !stage[k].squashed) {
+        cpu->counters.committed++;
+      }
     }
-  
 
-    if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Writeback", stage);
-    }
+    show_group(cpu, WB, stage);
   }
   return 0;
 }
@@ -992,7 +1423,7 @@ APEX_cpu_run(APEX_CPU* cpu)
       break;
     }
 
-    if (ENABLE_DEBUG_MESSAGES) {
+    if (cpu->debug_messages) {
       printf("--------------------------------\n");
       printf("Clock Cycle #: %d\n", cpu->clock);
       printf("--------------------------------\n");
@@ -1010,27 +1441,428 @@ APEX_cpu_run(APEX_CPU* cpu)
 
 int display_mem(APEX_CPU* cpu){
   
-    printf("\t**************  MEMORY  ************\n");
+    fprintf(cpu->out, "\t**************  MEMORY  ************\n");
   for(int i=0; i< 100 ; i++){
-    printf("\t |MEM[%d]| \t |Value=%d| \n",i,cpu->data_memory[i]);
+    fprintf(cpu->out, "\t |MEM[%d]| \t |Value=%d| \n",i,APEX_mem_load(cpu, i));
   }
 
   return 0;
 }
 
 int display_reg(APEX_CPU* cpu){
-  printf("\t**************  REGISTERS  ************\n");
+  fprintf(cpu->out, "\t**************  REGISTERS  ************\n");
   for(int i=0; i < 16 ; i++){
     if(cpu->regs_valid[i]==1 ){
-      printf("\t |REG[%d]| \t |Value=%d| \t |Status='VALID'|\n",i,cpu->regs[i]);
+      fprintf(cpu->out, "\t |REG[%d]| \t |Value=%d| \t |Status='VALID'|\n",i,cpu->regs[i]);
     }else if(cpu->regs_valid[i]==0){
-      printf("\t |REG[%d]| \t |Value=%d| \t |Status='INVALID'|\n",i,cpu->regs[i]);
+      fprintf(cpu->out, "\t |REG[%d]| \t |Value=%d| \t |Status='INVALID'|\n",i,cpu->regs[i]);
     }
   }
   
   return 0;
 }
 
+/*
+ * True once further cycles change nothing but the clock: the pipeline and
+ * the store queue have drained and fetch is halted or has run off code
+ * memory
+ */
+static int
+pipeline_idle(const APEX_CPU* cpu)
+{
+  const CPU_Stage* fetch_stage = cpu->stage[F];
+  int index = get_code_index(cpu->pc);
+  if (cpu->core == APEX_CORE_OOO) {
+    return APEX_ooo_idle(cpu);
+  }
+  if (!fetch_stage->busy && !fetch_stage->stalled && index >= 0 &&
+      index < cpu->code_memory_size) {
+    return 0;
+  }
+  if (cpu->store_queue.count > 0) {
+    return 0;
+  }
+
+  for (int i = cpu->next[F]; i < NUM_STAGES; i = cpu->next[i]) {
+    const CPU_Stage* stage = cpu->stage[i];
+    if (stage->opcode != OPCODE_NOP || stage->pc != 0 || stage->busy ||
+        stage->stalled) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Returns for how many cycles the group in DRF, with EX1 empty ahead of it,
+ * stays stalled in decode: until its unit is free and its sources are
+ * produced, INT_MAX while it waits for an older instruction to write one.
+ * 0 if it issues in this cycle or is a BZ, BNZ or HALT.
+ */
+static int
+decode_blocked_cycles(APEX_CPU* cpu)
+{
+  CPU_Stage* stage = cpu->stage[DRF];
+  APEX_Instruction ins = latch_ins(cpu, stage);
+  int flags = opcode_info[stage->opcode].flags;
+  int unit = APEX_unit(stage->opcode);
+  int units[APEX_NUM_UNITS] = { 0 };
+  int rs1_value;
+  int rs2_value;
+  int cycles = INT_MAX;
+
+  if (decode_table[stage->opcode] != decode_read_sources ||
+      (group_hazard(cpu, stage, 0, units) < 0 &&
+       sources_ready(cpu, stage, &rs1_value, &rs2_value))) {
+    return 0;
+  }
+  if (cpu->clock + 1 < cpu->unit_free[unit]) {
+    cycles = cpu->unit_free[unit] - cpu->clock - 1;
+  }
+  if ((flags & OPF_RS1) && cpu->reg_ready[APEX_rs1(ins)] > cpu->clock &&
+      cpu->reg_ready[APEX_rs1(ins)] - cpu->clock < cycles) {
+    cycles = cpu->reg_ready[APEX_rs1(ins)] - cpu->clock;
+  }
+  if ((flags & OPF_RS2) && cpu->reg_ready[APEX_rs2(ins)] > cpu->clock &&
+      cpu->reg_ready[APEX_rs2(ins)] - cpu->clock < cycles) {
+    cycles = cpu->reg_ready[APEX_rs2(ins)] - cpu->clock;
+  }
+  return cycles;
+}
+
+/* Lowers cycles to the cycles a wait counting down from wait leaves it
+ * running, false if it ends in this cycle
+ */
+static int
+wait_running(int wait, int* cycles)
+{
+  if (wait < 2) {
+    return 0;
+  }
+  if (wait - 1 < *cycles) {
+    *cycles = wait - 1;
+  }
+  return 1;
+}
+
+/*
+ * Returns how many cycles from this one on are known to repeat it: every
+ * occupied stage is held by a fixed wait, or stalled behind a stage that
+ * is, and each wait only counts down. The waits are a data cache access in
+ * MEM1, the extra latency of a unit in EX1, an instruction cache fill, a
+ * store queue write and decode waiting for a unit or a result. The stages
+ * are looked at from writeback back to fetch, as a cycle runs them. 0 if
+ * anything moves in this cycle.
+ */
+static int
+blocked_cycles(APEX_CPU* cpu)
+{
+  int order[NUM_STAGES];
+  int count = 0;
+  int cycles = INT_MAX;
+  int held = 0;		// The latch after the one looked at stays stalled
+  int mem_held = 0;
+
+  if (cpu->core != APEX_CORE_INORDER) {
+    return 0;
+  }
+  for (int id = F; id != NUM_STAGES; id = cpu->next[id]) {
+    order[count++] = id;
+  }
+
+  for (int i = count - 1; i >= 0; --i) {
+    int id = order[i];
+    const CPU_Stage* stage = cpu->stage[id];
+    int occupied = stage->pc != 0;
+    int index;
+    int can_fetch;
+
+    switch (id) {
+    case MEM1:
+      if (occupied &&
+          !(stage->stalled && wait_running(cpu->mem_wait, &cycles))) {
+        return 0;
+      }
+      if (!occupied && cpu->mem_wait > 0) {
+        return 0;
+      }
+      held = mem_held = occupied;
+      break;
+    case EX2:
+    case F2:
+    case F3:
+      /* Stalled exactly when the latch after it is */
+      if (occupied && !held) {
+        return 0;
+      }
+      break;
+    case EX1:
+      if (occupied && !held && !wait_running(cpu->ex_wait, &cycles)) {
+        return 0;
+      }
+      held = occupied;
+      break;
+    case DRF:
+      if (occupied && !held) {
+        int blocked = decode_blocked_cycles(cpu);
+        if (blocked == 0) {
+          return 0;
+        }
+        cycles = blocked < cycles ? blocked : cycles;
+      }
+      held = occupied;
+      break;
+    case F:
+      index = get_code_index(cpu->pc);
+      can_fetch = !stage->busy && !stage->stalled && index >= 0 &&
+                  index < cpu->code_memory_size;
+      if (can_fetch && cpu->icache) {
+        int offset = cpu->pc - cpu->buffer_pc;
+        if (offset < 0 || offset > 4 * cpu->buffer_count) {
+          return 0;
+        }
+        int buffered = cpu->buffer_count - offset / 4;
+        if (cpu->fetch_wait > 0) {
+          if (!wait_running(cpu->fetch_wait, &cycles)) {
+            return 0;
+          }
+        } else if (buffered < cpu->fetch_buffer_size &&
+                   index + buffered < cpu->code_memory_size) {
+          return 0;
+        }
+        can_fetch = buffered > 0;
+      }
+      if (can_fetch && !held) {
+        return 0;
+      }
+      break;
+    default:
+      if (occupied) {
+        return 0;
+      }
+      held = 0;
+    }
+  }
+
+  /* The oldest store writes the cache unless a held load has the port */
+  const APEX_Store_Queue* queue = &cpu->store_queue;
+  if (store_queue_enabled(cpu)) {
+    if (queue->wait > 0
+          ? !wait_running(queue->wait, &cycles)
+          : queue->count > 0 && !(queue->port_taken && mem_held)) {
+      return 0;
+    }
+  }
+  return cycles == INT_MAX ? 0 : cycles;
+}
+
+/*
+ * Returns how many of the next limit cycles are known to change nothing but
+ * the clock, the counters and the waits counting down: all of them once the
+ * pipeline is idle, up to the end of the shortest wait while every occupied
+ * stage is held by one, none otherwise. Cycles are only skipped when stage
+ * contents are neither printed nor traced.
+ */
+static int
+idle_cycles(APEX_CPU* cpu, int limit)
+{
+  if (cpu->verbosity >= APEX_VERBOSITY_STAGE || cpu->trace) {
+    return 0;
+  }
+  if (pipeline_idle(cpu)) {
+    return limit;
+  }
+  int blocked = blocked_cycles(cpu);
+  if (blocked < 2) {
+    return 0;
+  }
+  return blocked < limit ? blocked : limit;
+}
+
+/*
+ * Simulates one clock cycle of the pipeline
+ */
+int
+APEX_cpu_step(APEX_CPU* cpu)
+{
+  if (pipeline_idle(cpu)) {
+    cpu->counters.idle++;
+  }
+  if (cpu->core == APEX_CORE_OOO) {
+    return APEX_ooo_step(cpu);
+  }
+  if (cpu->trace) {
+    APEX_trace_begin_cycle(cpu->trace, cpu->clock);
+  }
+
+  /* Stages holding no instruction in this cycle; fetch counts its own */
+  const APEX_Pipeline* pipeline = &cpu->pipeline;
+  int in_flight = 0;
+  for (int i = 1; i < APEX_depth(cpu); ++i) {
+    int id = pipeline->stages[i].in;
+    if (cpu->stage[id]->pc == 0 || cpu->stage[id]->squashed) {
+      cpu->counters.bubbles[id]++;
+    } else {
+      in_flight = 1;
+    }
+  }
+  if (cpu->stage[F]->busy && in_flight) {
+    cpu->counters.stalls[APEX_STALL_HALT]++;
+  }
+
+  /* Stages run from writeback back to fetch, each handing its group to a
+   * latch already worked on in this cycle. The original pipeline, and the
+   * one a specialized build is fixed to, call them directly.
+   */
+  switch (APEX_depth(cpu)) {
+  case APEX_DEFAULT_DEPTH:
+    writeback(cpu);
+    memory2(cpu);
+    memory1(cpu);
+    execute2(cpu);
+    execute1(cpu);
+    decode(cpu);
+    fetch(cpu);
+    break;
+#if APEX_FIXED_DEPTH == 5
+  case 5:
+    writeback(cpu);
+    memory(cpu);
+    execute(cpu);
+    decode(cpu);
+    fetch(cpu);
+    break;
+#elif APEX_FIXED_DEPTH == 9
+  case 9:
+    writeback(cpu);
+    memory2(cpu);
+    memory1(cpu);
+    execute2(cpu);
+    execute1(cpu);
+    decode(cpu);
+    fetch3(cpu);
+    fetch2(cpu);
+    fetch(cpu);
+    break;
+#endif
+  default:
+    for (int i = pipeline->depth - 1; i >= 0; --i) {
+      pipeline->stages[i].run(cpu);
+    }
+  }
+  if (cpu->trace) {
+    APEX_trace_end_cycle(cpu->trace);
+  }
+  cpu->clock++;
+  return 0;
+}
+
+/* Adds times the counts of the cycle simulated since before */
+static void
+repeat_counts(long* counts, const long* before, int size, long times)
+{
+  for (int i = 0; i < size; ++i) {
+    counts[i] += (counts[i] - before[i]) * times;
+  }
+}
+
+static void
+repeat_counters(APEX_Counters* counters, const APEX_Counters* before,
+                long times)
+{
+  repeat_counts(&counters->committed, &before->committed, 1, times);
+  repeat_counts(counters->stalls, before->stalls, APEX_NUM_STALLS, times);
+  repeat_counts(&counters->forwarded, &before->forwarded, 1, times);
+  repeat_counts(counters->bubbles, before->bubbles, NUM_STAGES, times);
+  repeat_counts(counters->branches, before->branches, 2, times);
+  repeat_counts(&counters->flushed, &before->flushed, 1, times);
+  repeat_counts(&counters->mispredicts, &before->mispredicts, 1, times);
+  repeat_counts(&counters->penalty, &before->penalty, 1, times);
+  repeat_counts(&counters->idle, &before->idle, 1, times);
+  repeat_counts(counters->dcache, before->dcache, APEX_NUM_CACHE_EVENTS,
+                times);
+  repeat_counts(&counters->store_forwarded, &before->store_forwarded, 1,
+                times);
+  repeat_counts(counters->icache, before->icache, APEX_NUM_CACHE_EVENTS,
+                times);
+}
+
+/* Counts a wait down as often again as in the cycle simulated since it was
+ * before, stopping at 0
+ */
+static void
+repeat_wait(int* wait, int before, int times)
+{
+  if (before > 0 && *wait == before - 1) {
+    *wait = *wait > times ? *wait - times : 0;
+  }
+}
+
+/*
+ * Advances the clock over the cycles idle_cycles found, accounting for them
+ * as if each had been simulated. An idle cycle is a bubble in every stage
+ * of the pipeline. Of held cycles the first is simulated, and the others
+ * add as much to every counter and count the waits down as far.
+ */
+static void
+skip_idle_cycles(APEX_CPU* cpu, int cycles)
+{
+  if (pipeline_idle(cpu)) {
+    cpu->clock += cycles;
+    cpu->counters.idle += cycles;
+    for (int i = 0; i < APEX_depth(cpu) && cpu->core == APEX_CORE_INORDER;
+         ++i) {
+      cpu->counters.bubbles[cpu->pipeline.stages[i].in] += cycles;
+    }
+    return;
+  }
+
+  APEX_Counters before = cpu->counters;
+  int ex_wait = cpu->ex_wait;
+  int mem_wait = cpu->mem_wait;
+  int fetch_wait = cpu->fetch_wait;
+  int queue_wait = cpu->store_queue.wait;
+
+  APEX_cpu_step(cpu);
+  cycles--;
+  cpu->clock += cycles;
+  repeat_counters(&cpu->counters, &before, cycles);
+  repeat_wait(&cpu->ex_wait, ex_wait, cycles);
+  repeat_wait(&cpu->mem_wait, mem_wait, cycles);
+  repeat_wait(&cpu->fetch_wait, fetch_wait, cycles);
+  repeat_wait(&cpu->store_queue.wait, queue_wait, cycles);
+}
+
+/*
+ * Simulates the given number of clock cycles
+ */
+int
+APEX_cpu_run_cycles(APEX_CPU* cpu, int cycles)
+{
+  int done = 0;
+  while (done < cycles) {
+    int idle = idle_cycles(cpu, cycles - done);
+    if (idle) {
+      skip_idle_cycles(cpu, idle);
+      done += idle;
+    } else {
+      APEX_cpu_step(cpu);
+      done++;
+    }
+  }
+  return 0;
+}
+
+void
+APEX_cpu_get_stats(const APEX_CPU* cpu, APEX_Stats* stats)
+{
+  stats->clock = cpu->clock;
+  stats->ins_completed = cpu->counters.committed;
+  stats->pc = cpu->pc;
+  stats->fast_forwarded = cpu->fast_forwarded;
+  stats->counters = cpu->counters;
+}
+
 /*
  *  APEX CPU simulation loop
  *
@@ -1038,61 +1870,40 @@ int display_reg(APEX_CPU* cpu){
  *         implementation
  */
 int
-APEX_cpu_run(APEX_CPU* cpu, const char* command, const char* cycle)
+APEX_cpu_run(APEX_CPU* cpu, const char* cycle)
 {
-  cpu->clock=1;
-    //printf("clock bef: %d\n", cpu->clock);
-  int numberOfCycles = atoi(cycle); 
-  while (cpu->clock <=  numberOfCycles) {
-
-    /* All the instructions committed, so exit */
-    //printf("cpu mem size %d", cpu->code_memory_size);
-   // printf("\n ins completed: %d",cpu->ins_completed);
-    /*if (cpu->ins_completed == cpu->code_memory_size ) {
-      printf("(apex) >> Cycles Complete\n");
-      break;
-    }*/
+  int numberOfCycles = atoi(cycle);
+  for (int i = 0; i < numberOfCycles; ++i) {
+    int idle = idle_cycles(cpu, numberOfCycles - i);
+    if (idle) {
+      int clock = cpu->clock;
+      skip_idle_cycles(cpu, idle);
+      for (int j = 1; j <= idle && cpu->verbosity >= APEX_VERBOSITY_CYCLE;
+           ++j) {
+        fprintf(cpu->out, "Clock : %d \n", clock + j + 1);
+      }
+      i += idle - 1;
+      continue;
+    }
 
-    if (ENABLE_DEBUG_MESSAGES && strcmp(command, "display")==0 ) {
-      printf("--------------------------------\n");
-      printf("Clock Cycle #: %d\n", cpu->clock);
-      printf("--------------------------------\n");
+    if (cpu->verbosity >= APEX_VERBOSITY_STAGE) {
+      fprintf(cpu->out, "--------------------------------\n");
+      fprintf(cpu->out, "Clock Cycle #: %d\n", cpu->clock + 1);
+      fprintf(cpu->out, "--------------------------------\n");
     }
 
-    writeback(cpu, command);
-    memory2(cpu, command);
-    memory1(cpu, command);
-    execute2(cpu,command);
-    execute1(cpu, command);
-    
-  /*
-  // Before Decode Logic to Un Stall the things if Data is Dependency has gone
-  if(cpu->regs_valid[cpu->stage[DRF].rs1] == 1 && cpu->regs_valid[cpu->stage[DRF].rs2] == 1){
-    cpu->stage[DRF].stalled = 0;
-    cpu->stage[F].stalled = 0;
+    APEX_cpu_step(cpu);
+    if (cpu->verbosity >= APEX_VERBOSITY_CYCLE) {
+      fprintf(cpu->out, "Clock : %d \n", cpu->clock + 1);
+    }
   }
-  */
 
-    //fetch(cpu, command);
-    
-    decode(cpu, command);
-  
-  //  After Decode Logic to Stall the things if Data Dependenent has gone
-   /*
-   if( cpu->regs_valid[cpu->stage[DRF].rs1] == 0 || cpu->regs_valid[cpu->stage[DRF].rs2] == 0){
-    CPU_Stage nop;
-    memset(&nop, 0, sizeof(nop));
-    memcpy(&nop.opcode, "NOP", 3);
-    cpu->stage[EX1] = nop;
-  }
-  */
-  
-    fetch(cpu, command);
-    cpu->clock++;
-    printf("Clock : %d \n", cpu->clock);
+  if (cpu->verbosity >= APEX_VERBOSITY_SUMMARY) {
+    display_reg(cpu);
+  }
+  if (cpu->report) {
+    APEX_cpu_write_report(cpu, cpu->report);
   }
-
-  display_reg(cpu);
  // display_mem(cpu);
   return 0;
-}
\ No newline at end of file
+}
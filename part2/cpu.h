@@ -8,9 +8,18 @@
  */
 #ifndef _APEX_CPU_H_
 #define _APEX_CPU_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Latches of the pipeline in program order. Every configuration has F, DRF
+ * and the four of EX and MEM; F2 and F3 only the 9-stage one.
+ */
 enum
 {
   F,
+  F2,
+  F3,
   DRF,
   EX1,
   EX2,
@@ -20,35 +29,457 @@ enum
   NUM_STAGES
 };
 
-/* Format of an APEX instruction  */
-typedef struct APEX_Instruction
+/* Integer opcodes, resolved once from the mnemonic when code memory is
+ * created so that the pipeline never compares strings
+ */
+enum
+{
+  OPCODE_NONE,		// Empty latch or unrecognised mnemonic
+  OPCODE_NOP,
+  OPCODE_MOVC,
+  OPCODE_ADD,
+  OPCODE_ADDL,
+  OPCODE_SUB,
+  OPCODE_SUBL,
+  OPCODE_MUL,
+  OPCODE_AND,
+  OPCODE_OR,
+  OPCODE_EXOR,
+  OPCODE_LOAD,
+  OPCODE_STORE,
+  OPCODE_BZ,
+  OPCODE_BNZ,
+  OPCODE_HALT,
+  NUM_OPCODES
+};
+
+/* Operand-class flags of an opcode. The four operand flags occupy the low
+ * bits in the order the operands appear in the assembly text: rd, rs1, rs2,
+ * imm.
+ */
+#define OPF_RD      0x01	// Writes a destination register
+#define OPF_RS1     0x02	// Reads source register 1
+#define OPF_RS2     0x04	// Reads source register 2
+#define OPF_IMM     0x08	// Carries a literal
+#define OPF_SETS_ZF 0x10	// Result updates the zero flag
+#define OPF_BRANCH  0x20	// Conditional branch on the zero flag
+#define OPF_MEM     0x40	// Accesses data memory
+
+/* Static description of an opcode */
+typedef struct APEX_Opcode_Info
+{
+  const char* name;	// Assembly mnemonic
+  int flags;		// OPF_* operand-class flags
+} APEX_Opcode_Info;
+
+extern const APEX_Opcode_Info opcode_info[NUM_OPCODES];
+
+/* Format of an APEX instruction. Every instruction is encoded once into a
+ * 32-bit word, the same word that is stored in a binary object file:
+ *
+ *   31    27 26   22 21   17 16   12 11         0
+ *  | opcode |  rd   |  rs1  |  rs2  |  imm[11:0] |  opcodes reading rs2
+ *  | opcode |  rd   |  rs1  |       imm[16:0]    |  all other opcodes
+ *
+ * The literal is signed.
+ */
+typedef uint32_t APEX_Instruction;
+
+#define APEX_NUM_REGS 32
+#define APEX_DATA_MEMORY_SIZE 4096	// Default words of data memory
+
+static inline int
+APEX_opcode(APEX_Instruction ins)
+{
+  return ins >> 27;
+}
+
+static inline int
+APEX_rd(APEX_Instruction ins)
+{
+  return (ins >> 22) & 0x1f;
+}
+
+static inline int
+APEX_rs1(APEX_Instruction ins)
+{
+  return (ins >> 17) & 0x1f;
+}
+
+static inline int
+APEX_rs2(APEX_Instruction ins)
+{
+  return (ins >> 12) & 0x1f;
+}
+
+/* Width of the literal field of an opcode */
+static inline int
+APEX_imm_bits(int opcode)
+{
+  return (opcode_info[opcode].flags & OPF_RS2) ? 12 : 17;
+}
+
+static inline int
+APEX_imm(APEX_Instruction ins)
+{
+  int shift = 32 - APEX_imm_bits(APEX_opcode(ins));
+  return (int32_t)(ins << shift) >> shift;
+}
+
+static inline APEX_Instruction
+APEX_encode(int opcode, int rd, int rs1, int rs2, int imm)
+{
+  uint32_t imm_mask = (1u << APEX_imm_bits(opcode)) - 1;
+  return ((uint32_t)opcode << 27) | ((uint32_t)rd << 22) |
+         ((uint32_t)rs1 << 17) | ((uint32_t)rs2 << 12) |
+         ((uint32_t)imm & imm_mask);
+}
+
+/* Header of a binary APEX object file, followed by count instruction words
+ * in host byte order
+ */
+#define APEX_OBJECT_MAGIC "APXO"
+#define APEX_OBJECT_VERSION 1
+
+typedef struct APEX_Object_Header
+{
+  char magic[4];	// APEX_OBJECT_MAGIC
+  uint16_t version;	// APEX_OBJECT_VERSION
+  uint16_t header_size;	// Offset of the first instruction word
+  uint32_t count;	// Number of instructions
+  uint32_t reserved;
+} APEX_Object_Header;
+
+/* Header of an APEX snapshot file, followed by the cpu state as 32-bit
+ * values in host byte order. The version changes whenever the state does.
+ */
+#define APEX_SNAPSHOT_MAGIC "APXS"
+#define APEX_SNAPSHOT_VERSION 12
+
+typedef struct APEX_Snapshot_Header
+{
+  char magic[4];	// APEX_SNAPSHOT_MAGIC
+  uint16_t version;	// APEX_SNAPSHOT_VERSION
+  uint16_t header_size;	// Offset of the cpu state
+  uint32_t code_size;	// Instructions of the program it was taken from
+  uint32_t code_checksum;	// FNV-1a hash of that program's code memory
+} APEX_Snapshot_Header;
+
+/* Header of an APEX trace file, followed by one APEX_Trace_Record per
+ * simulated cycle in host byte order
+ */
+#define APEX_TRACE_MAGIC "APXT"
+#define APEX_TRACE_VERSION 2
+
+typedef struct APEX_Trace_Header
+{
+  char magic[4];	// APEX_TRACE_MAGIC
+  uint16_t version;	// APEX_TRACE_VERSION
+  uint16_t header_size;	// Offset of the first record
+  uint32_t record_size;	// sizeof(APEX_Trace_Record)
+  uint32_t code_size;	// Instructions of the traced program
+  uint32_t code_checksum;	// FNV-1a hash of its code memory
+  uint32_t depth;	// Stages of the traced pipeline
+} APEX_Trace_Header;
+
+#define APEX_TRACE_SHOWN   0x01	// The stage showed this latch in the cycle
+#define APEX_TRACE_BUSY    0x02
+#define APEX_TRACE_STALLED 0x04
+
+/* Latch shown by one stage in a traced cycle */
+typedef struct APEX_Trace_Stage
 {
-  char opcode[128];	// Operation Code
-  int rd;		    // Destination Register Address
-  int rs1;		    // Source-1 Register Address
-  int rs2;		    // Source-2 Register Address
-  int imm;		    // Literal Value
-} APEX_Instruction;
+  int32_t pc;
+  int32_t index;	// Code memory index of the instruction
+  uint8_t opcode;
+  uint8_t flags;	// APEX_TRACE_* bits
+  uint16_t reserved;
+} APEX_Trace_Stage;
 
-/* Model of CPU stage latch */
+typedef struct APEX_Trace_Record
+{
+  uint32_t clock;	// Cycles elapsed before this one
+  uint32_t reserved;
+  APEX_Trace_Stage stage[NUM_STAGES];	// Indexed by stage, F to WB
+} APEX_Trace_Record;
+
+/* Model of CPU stage latch. The latch refers to its instruction by code
+ * memory index and only carries the values produced in flight, so that it
+ * stays within a cache line.
+ */
 typedef struct CPU_Stage
 {
   int pc;		    // Program Counter
-  char opcode[128];	// Operation Code
-  int rs1;		    // Source-1 Register Address
-  int rs2;		    // Source-2 Register Address
-  int rd;		    // Destination Register Address
-  int imm;		    // Literal Value
+  int index;		// Code memory index of the instruction
+  unsigned char opcode;	// Operation Code (OPCODE_*), NOP once squashed
+  unsigned char busy;	// Flag to indicate, stage is performing some action
+  unsigned char stalled;	// Flag to indicate, stage is stalled
+  unsigned char squashed;	// Wrong-path instruction turned into a NOP
+  unsigned char predicted;	// Direction fetch predicted for BZ/BNZ
+  unsigned short prediction_slot;	// Pattern table entry it was read from
   int rs1_value;	// Source-1 Register Value
   int rs2_value;	// Source-2 Register Value
-  int rd_value;	       // dESTINATION Register Value
   int buffer;		// Latch to hold some value
   int mem_address;	// Computed Memory Address
-  int busy;		    // Flag to indicate, stage is performing some action
-  int stalled;		// Flag to indicate, stage is stalled
-  int zf;		// Zero Flag Variable
 } CPU_Stage;
 
+_Static_assert(sizeof(CPU_Stage) <= 64, "CPU_Stage must fit in a cache line");
+
+/* Reasons for an instruction to be held in decode, or for fetch to be */
+enum
+{
+  APEX_STALL_RAW,	// A register it accesses is still to be written
+  APEX_STALL_BRANCH,	// BZ/BNZ waiting for the zero flag
+  APEX_STALL_HALT,	// Fetch stopped by HALT while the pipeline drains
+  APEX_STALL_ROB,	// Out-of-order core: reorder buffer full
+  APEX_STALL_RS,	// Out-of-order core: no free reservation station
+  APEX_STALL_LSQ,	// Load/store queue or in-order store queue full
+  APEX_STALL_UNIT,	// Functional unit taken by an older slot or instruction
+  APEX_STALL_DCACHE,	// Group held in MEM1 by a data cache access
+  APEX_STALL_ICACHE,	// Fetch buffer waiting for the instruction cache
+  APEX_NUM_STALLS
+};
+
+/* Issue width of the in-order pipeline. Each stage holds a group of up to
+ * width instructions, oldest in slot 0; fetch ends a group at BZ, BNZ or
+ * HALT. Per cycle a group issues at most APEX_MUL_UNITS multiplications and
+ * APEX_MEM_PORTS loads or stores.
+ */
+#define APEX_MAX_WIDTH 4
+#define APEX_MUL_UNITS 1
+#define APEX_MEM_PORTS 1
+
+/* Functional units, each executing one class of instructions */
+enum
+{
+  APEX_UNIT_ALU,
+  APEX_UNIT_MUL,
+  APEX_UNIT_MEM,	// Address generation of LOAD and STORE
+  APEX_UNIT_BRANCH,	// BZ and BNZ
+  APEX_NUM_UNITS
+};
+
+#define APEX_UNIT_MAX_CYCLES 64
+
+/* Timing of a functional unit. A pipelined unit accepts an instruction
+ * every cycle, an iterative one only once the previous one is done.
+ */
+typedef struct APEX_Unit_Config
+{
+  int latency;		// Cycles from EX1 until the result, at least 1
+  int interval;		// Cycles between two instructions it accepts
+} APEX_Unit_Config;
+
+static inline int
+APEX_unit(int opcode)
+{
+  if (opcode == OPCODE_MUL) {
+    return APEX_UNIT_MUL;
+  }
+  if (opcode_info[opcode].flags & OPF_BRANCH) {
+    return APEX_UNIT_BRANCH;
+  }
+  return (opcode_info[opcode].flags & OPF_MEM) ? APEX_UNIT_MEM : APEX_UNIT_ALU;
+}
+
+/* Paths of the forwarding network into decode */
+#define APEX_FORWARD_ALU  0x01	// ALU results from the latch after EX1
+#define APEX_FORWARD_LOAD 0x02	// Loaded values from the latch after MEM1
+#define APEX_FORWARD_ALL  (APEX_FORWARD_ALU | APEX_FORWARD_LOAD)
+
+/* Events counted for each cache */
+enum
+{
+  APEX_CACHE_HIT,
+  APEX_CACHE_MISS,
+  APEX_CACHE_EVICTION,	// Valid line replaced on a miss
+  APEX_CACHE_WRITEBACK,	// Dirty line written back to memory
+  APEX_NUM_CACHE_EVENTS
+};
+
+/* Performance counters of the pipeline, reset only with the cpu */
+typedef struct APEX_Counters
+{
+  long committed;	// Instructions that left writeback
+  long stalls[APEX_NUM_STALLS];	// Cycles lost, by cause
+  long forwarded;	// RAW stall cycles avoided by forwarding
+  long bubbles[NUM_STAGES];	// Cycles each stage held no instruction
+  long branches[2];	// BZ/BNZ resolved, indexed by taken
+  long flushed;		// Wrong-path instructions squashed
+  long mispredicts;	// BZ/BNZ resolved against the fetch prediction
+  long penalty;		// Fetch slots discarded by redirects
+  long idle;		// Cycles after the program ran to completion
+  long dcache[APEX_NUM_CACHE_EVENTS];	// Data cache, by APEX_CACHE_*
+  long store_forwarded;	// Loads served by an older store not yet written
+  long icache[APEX_NUM_CACHE_EVENTS];	// Instruction cache
+} APEX_Counters;
+
+/* Direction predictors for BZ/BNZ. Without one, fetch falls through and a
+ * taken branch redirects once in EX2 and once more in MEM1.
+ */
+enum
+{
+  APEX_PREDICT_NONE,
+  APEX_PREDICT_STATIC,	// Backward taken, forward not taken
+  APEX_PREDICT_BIMODAL,	// 2-bit counter per branch address
+  APEX_PREDICT_GSHARE,	// 2-bit counter per address and global history
+  APEX_NUM_PREDICTORS
+};
+
+#define APEX_BTB_SIZE 64	// Branch target buffer entries, a power of two
+#define APEX_PHT_BITS 10	// Log2 of the pattern history table size
+
+/* Branch prediction unit consulted by fetch and trained in EX2. A branch
+ * is only predicted taken when the BTB knows its target.
+ */
+typedef struct APEX_Predictor
+{
+  int kind;		// APEX_PREDICT_*
+  int history;		// Outcomes of the last resolved branches, newest in
+			// bit 0
+  unsigned char pht[1 << APEX_PHT_BITS];	// 2-bit saturating counters
+  int btb_pc[APEX_BTB_SIZE];	// Branch of each entry, 0 when empty
+  int btb_target[APEX_BTB_SIZE];
+} APEX_Predictor;
+
+/* Replacement policies of the data cache */
+enum
+{
+  APEX_REPLACE_LRU,
+  APEX_REPLACE_PLRU,	// Tree pseudo-LRU
+  APEX_REPLACE_RANDOM,
+  APEX_NUM_REPLACEMENTS
+};
+
+/* Geometry and timing of a cache. Sizes count words, the unit of a
+ * LOAD/STORE address and of an instruction, and are powers of two.
+ */
+typedef struct APEX_Cache_Config
+{
+  int size;		// Words held
+  int ways;		// Lines per set, at most 32
+  int line;		// Words per line
+  int replacement;	// APEX_REPLACE_*
+  int write_back;	// 1 write-back/allocate, 0 write-through/no-allocate
+  int hit_latency;	// Cycles of a hit, at least 1
+  int miss_latency;	// Cycles of a memory access
+} APEX_Cache_Config;
+
+typedef struct APEX_Cache_Line
+{
+  int tag;		// Line address of the block held
+  int valid;
+  int dirty;
+  int stamp;		// Access of the last use, for LRU
+} APEX_Cache_Line;
+
+/* L1 cache in front of data or code memory. Memory keeps every value, the
+ * cache only tracks the lines it holds, so that it decides the latency of
+ * an access and nothing else.
+ */
+typedef struct APEX_Cache
+{
+  APEX_Cache_Config config;
+  int sets;
+  int accesses;		// Accesses so far, the LRU clock
+  int seed;		// State of the random replacement generator
+  int* plru;		// Tree bits of each set
+  APEX_Cache_Line* lines;	// Set after set, ways lines each
+} APEX_Cache;
+
+#define APEX_FETCH_BUFFER_MAX 64
+#define APEX_STORE_QUEUE_MAX 16
+
+/* Stores that left MEM1 and still have to write the data cache, oldest at
+ * head. Like the cache, the queue only decides timing: a store updates
+ * data memory in MEM1 and its entry keeps the address until the cache
+ * write is done. A load to a queued address takes the value from the
+ * queue, any other load goes ahead of the queued stores.
+ */
+typedef struct APEX_Store_Queue
+{
+  int size;		// Entries, 0 for stores to write the cache in MEM1
+  int address[APEX_STORE_QUEUE_MAX];
+  int head;
+  int count;
+  int wait;		// Cycles left of the head's cache write, 0 if not started
+  int pending;		// The store in MEM1 waits for a free entry
+  int pending_address;
+  int port_taken;	// The load in MEM1 holds the cache port
+} APEX_Store_Queue;
+
+/* Data memory is paged: a word address splits into a root index, a table
+ * index and the word within its page. The root only grows to the tables
+ * that have been stored to, at most as far as the size of data memory.
+ */
+#define APEX_PAGE_BITS 10
+#define APEX_TABLE_BITS 8
+#define APEX_PAGE_SIZE (1 << APEX_PAGE_BITS)	// Words
+#define APEX_NO_PAGE UINT32_MAX
+
+/* Sparse data memory. Pages, and the tables pointing at them, are allocated
+ * by the first store to them, so that a cpu only holds the memory its
+ * program touched; words never stored read as 0. The page of the last
+ * access that found one is kept aside for the next access to hit.
+ */
+typedef struct APEX_Memory
+{
+  uint64_t size;	// Words addressable, a multiple of APEX_PAGE_SIZE
+  int*** root;		// Tables of pages, NULL until the first store
+  uint32_t root_size;	// Entries of root
+  long pages;		// Pages allocated
+  uint32_t hot_number;	// Page number of hot_page, APEX_NO_PAGE for none
+  int* hot_page;
+} APEX_Memory;
+
+/* Core models a cpu can simulate its program on */
+enum
+{
+  APEX_CORE_INORDER,	// The 7-stage pipeline
+  APEX_CORE_OOO,	// Renaming, reservation stations and a reorder buffer
+};
+
+/* Output levels of a cpu, each printing everything the previous one does */
+enum
+{
+  APEX_VERBOSITY_SILENT,	// Nothing at all
+  APEX_VERBOSITY_SUMMARY,	// Register file at the end of a run
+  APEX_VERBOSITY_CYCLE,		// A line per simulated cycle
+  APEX_VERBOSITY_STAGE,		// Code memory and every stage of every cycle
+};
+
+/* Buffer of the output stream, so that printing is one write per buffer */
+#define APEX_OUTPUT_BUFFER_SIZE (1 << 20)
+
+/* A stage of the in-order pipeline: its name in the pipeline view and its
+ * key in the report, the work it does in a cycle, the latch its group is in
+ * and the latch it hands the group to. A stage doing the work of several
+ * latches in one cycle moves its group through the latches from in up to
+ * last, which is in for every other stage.
+ */
+struct APEX_CPU;
+
+typedef struct APEX_Stage_Desc
+{
+  const char* name;
+  const char* key;
+  int (*run)(struct APEX_CPU* cpu);
+  int in;
+  int last;
+  int out;		// NUM_STAGES for writeback
+} APEX_Stage_Desc;
+
+#define APEX_DEFAULT_DEPTH 7
+
+/* Stages of an in-order pipeline from fetch to writeback, which a cycle
+ * runs back to front
+ */
+typedef struct APEX_Pipeline
+{
+  int depth;
+  APEX_Stage_Desc stages[NUM_STAGES];
+} APEX_Pipeline;
+
 /* Model of APEX CPU */
 typedef struct APEX_CPU
 {
@@ -58,75 +489,419 @@ typedef struct APEX_CPU
   /* Current program counter */
     
  int pc;
- /* Counter for MUL which has been set initially in writeback*/
-   int counter;
 
+  /* Branch state: zero flag of the last ADD, SUB or MUL, the decode wait
+   * of BZ/BNZ behind such an instruction and the target of a taken branch
+   */
+  int zero_flag;
+  int branch_wait;
+  int branch_target;
+
+  /* Instructions fetched, decoded and issued per cycle, 1 to APEX_MAX_WIDTH */
+  int width;
+
+  /* Functional unit timing, the clock from which each unit accepts its
+   * next instruction and from which each register and the zero flag can be
+   * read. EX1 holds a group for the extra latency of a memory or branch
+   * unit for ex_wait more cycles, -1 until the group has executed.
+   */
+  APEX_Unit_Config units[APEX_NUM_UNITS];
+  int unit_free[APEX_NUM_UNITS];
+  int reg_ready[APEX_NUM_REGS];
+  int zero_flag_ready;
+  int ex_wait;
+
+  /* Forwarding paths in use (APEX_FORWARD_*), 0 to wait for writeback */
+  int forwarding;
+  APEX_Predictor predictor;
+
+
+  /* Data cache of the MEM stages, NULL for fixed latency data memory, and
+   * the cycles the group in MEM1 is still held by its access
+   */
+  APEX_Cache* dcache;
+  int mem_wait;
+
+  /* Stores on their way to the data cache, only used with one */
+  APEX_Store_Queue store_queue;
+
+  /* Instruction cache in front of fetch, NULL for single-cycle fetch. It
+   * fills the fetch buffer, which holds the buffer_count instructions from
+   * buffer_pc on; the line requested after them is due in fetch_wait
+   * cycles.
+   */
+  APEX_Cache* icache;
+  int fetch_buffer_size;	// Instructions, 1 to APEX_FETCH_BUFFER_MAX
+  int buffer_pc;
+  int buffer_count;
+  int fetch_wait;
 
   /* Integer register file */
   int regs[32];
   int regs_valid[32];
 
-  /* Array of 5 CPU_stage */
-  CPU_Stage stage[7];
+  /* Latch group of each pipeline stage, one latch per issue slot, with
+   * unused slots holding bubbles. Groups advance by exchanging the pointers,
+   * the storage behind them lives in latches.
+   */
+  CPU_Stage* stage[NUM_STAGES];
+  CPU_Stage latches[NUM_STAGES][APEX_MAX_WIDTH];
+
+  /* Stages of the pipeline, built from the layout of its depth, and for
+   * each latch it uses the latch its group moves into and the name it is
+   * shown under, NULL if it is not shown
+   */
+  APEX_Pipeline pipeline;
+  int next[NUM_STAGES];
+  const char* stage_name[NUM_STAGES];
 
   /* Code Memory where instructions are stored */
-  APEX_Instruction* code_memory;
+  const APEX_Instruction* code_memory;
   int code_memory_size;
 
+  /* Mapping of the object file backing code memory, NULL when code memory
+   * was parsed from text
+   */
+  void* code_mapping;
+  size_t code_mapping_size;
+
+  /* Translation cache of APEX_cpu_jit_run and pre-decoded program of
+   * APEX_cpu_threaded_run, NULL until first used
+   */
+  void* jit;
+  void* threaded_code;
+
+  /* Core model (APEX_CORE_*) and the out-of-order core's state, NULL until
+   * it simulates a cycle
+   */
+  int core;
+  void* ooo;
+
   /* Data Memory */
-  int data_memory[4096];
+  APEX_Memory memory;
 
   /* Some stats */
-  int ins_completed;
+  APEX_Counters counters;
+  long fast_forwarded;	// Instructions executed by APEX_cpu_fast_forward
+
+  /* What the cpu prints while simulating (APEX_VERBOSITY_*) and where */
+  int verbosity;
+  FILE* out;
+
+  /* Binary trace of every simulated cycle, NULL when not tracing */
+  struct APEX_Trace* trace;
+
+  /* Receives the counter report at the end of APEX_cpu_run, NULL for none */
+  FILE* report;
 
 } APEX_CPU;
 
+/* Specialized builds (make variants) compile the simulator for a single
+ * configuration. Each APEX_FIXED_* setting given on the command line turns
+ * a field the pipeline reads in every cycle into a constant, so that the
+ * compiler folds the tests on it. A cpu of such a build starts out with the
+ * fixed settings and APEX_cpu_check_build refuses any other. Unset, width
+ * and depth are 0 and forwarding and predictor -1.
+ */
+#ifndef APEX_FIXED_WIDTH
+#define APEX_FIXED_WIDTH 0
+#endif
+#ifndef APEX_FIXED_DEPTH
+#define APEX_FIXED_DEPTH 0
+#endif
+#ifndef APEX_FIXED_FORWARDING
+#define APEX_FIXED_FORWARDING -1
+#endif
+#ifndef APEX_FIXED_PREDICTOR
+#define APEX_FIXED_PREDICTOR -1
+#endif
+#ifndef APEX_FIXED_UNITS
+#define APEX_FIXED_UNITS 0	// 1 for one-cycle pipelined units only
+#endif
+
+/* Settings a cpu starts out with */
+#define APEX_START_WIDTH (APEX_FIXED_WIDTH ? APEX_FIXED_WIDTH : 1)
+#define APEX_START_DEPTH (APEX_FIXED_DEPTH ? APEX_FIXED_DEPTH : APEX_DEFAULT_DEPTH)
+#define APEX_START_FORWARDING \
+  (APEX_FIXED_FORWARDING >= 0 ? APEX_FIXED_FORWARDING : 0)
+#define APEX_START_PREDICTOR \
+  (APEX_FIXED_PREDICTOR >= 0 ? APEX_FIXED_PREDICTOR : APEX_PREDICT_NONE)
+
+static inline int
+APEX_width(const APEX_CPU* cpu)
+{
+  return APEX_FIXED_WIDTH ? APEX_FIXED_WIDTH : cpu->width;
+}
+
+static inline int
+APEX_depth(const APEX_CPU* cpu)
+{
+  return APEX_FIXED_DEPTH ? APEX_FIXED_DEPTH : cpu->pipeline.depth;
+}
+
+static inline int
+APEX_forwarding(const APEX_CPU* cpu)
+{
+  return APEX_FIXED_FORWARDING >= 0 ? APEX_FIXED_FORWARDING : cpu->forwarding;
+}
+
+/* Direction predictor in use, APEX_PREDICT_* */
+static inline int
+APEX_prediction(const APEX_CPU* cpu)
+{
+  return APEX_FIXED_PREDICTOR >= 0 ? APEX_FIXED_PREDICTOR
+                                   : cpu->predictor.kind;
+}
+
+static inline const APEX_Unit_Config*
+APEX_unit_timing(const APEX_CPU* cpu, int unit)
+{
+  static const APEX_Unit_Config one_cycle = { 1, 1 };
+  return APEX_FIXED_UNITS ? &one_cycle : &cpu->units[unit];
+}
+
+/* Statistics reported to an embedding program */
+typedef struct APEX_Stats
+{
+  int clock;		// Clock cycles simulated
+  int ins_completed;	// Instructions committed by writeback
+  int pc;		// Current program counter
+  long fast_forwarded;	// Instructions executed without timing
+  APEX_Counters counters;
+} APEX_Stats;
+
+int
+APEX_memory_load(APEX_Memory* memory, uint32_t address);
+
+void
+APEX_memory_store(APEX_Memory* memory, uint32_t address, int value);
+
+/* Architectural helpers shared by the pipeline and the functional model.
+ * Data memory accesses outside of data memory read as 0 and are not stored.
+ * Accesses to the hot page are served inline, the others by memory.c.
+ */
+static inline int
+APEX_mem_load(APEX_CPU* cpu, int address)
+{
+  APEX_Memory* memory = &cpu->memory;
+  if ((uint32_t)address >> APEX_PAGE_BITS == memory->hot_number) {
+    return memory->hot_page[address & (APEX_PAGE_SIZE - 1)];
+  }
+  return APEX_memory_load(memory, address);
+}
+
+static inline void
+APEX_mem_store(APEX_CPU* cpu, int address, int value)
+{
+  APEX_Memory* memory = &cpu->memory;
+  if ((uint32_t)address >> APEX_PAGE_BITS == memory->hot_number) {
+    memory->hot_page[address & (APEX_PAGE_SIZE - 1)] = value;
+  } else {
+    APEX_memory_store(memory, address, value);
+  }
+}
+
+/* Word aligned target of a taken BZ/BNZ at pc */
+static inline int
+APEX_branch_target(int pc, int imm)
+{
+  int target = pc + imm;
+  return target - target % 4;
+}
+
 APEX_Instruction*
 create_code_memory(const char* filename, int* size);
 
+APEX_Instruction*
+create_code_memory_from_buffer(const char* text, size_t length, int* size);
+
+int
+is_object_file(const char* filename);
+
+const APEX_Instruction*
+map_object_file(const char* filename, int* size, void** mapping,
+                size_t* mapping_size);
+
+const APEX_Instruction*
+object_image_code(const void* image, size_t image_size, int* size);
+
+int
+write_object_file(const char* filename, const APEX_Instruction* code,
+                  int size);
+
+int
+APEX_verbosity_from_command(const char* command);
+
+void
+APEX_cpu_set_output(APEX_CPU* cpu, int verbosity, FILE* out);
+
+APEX_CPU*
+APEX_cpu_init(const char* filename, int verbosity);
+
+APEX_CPU*
+APEX_cpu_load(const char* filename);
+
 APEX_CPU*
-APEX_cpu_init(const char* filename);
+APEX_cpu_init_from_buffer(const void* buffer, size_t size);
+
+int
+APEX_cpu_step(APEX_CPU* cpu);
+
+int
+APEX_cpu_run_cycles(APEX_CPU* cpu, int cycles);
+
+void
+APEX_cpu_get_stats(const APEX_CPU* cpu, APEX_Stats* stats);
+
+int
+APEX_predictor_kind(const char* name);
+
+int
+APEX_predict(APEX_CPU* cpu, CPU_Stage* stage);
+
+void
+APEX_predictor_update(APEX_CPU* cpu, const CPU_Stage* stage, int taken,
+                      int target);
 
 int
-APEX_cpu_run(APEX_CPU* cpu, const char* command, const char* cycle);
+APEX_cpu_write_report(const APEX_CPU* cpu, FILE* out);
+
+void
+APEX_memory_init(APEX_Memory* memory, uint64_t size);
+
+int*
+APEX_memory_page(APEX_Memory* memory, uint32_t number, int allocate);
+
+uint32_t
+APEX_memory_next_page(const APEX_Memory* memory, uint32_t number);
+
+int
+APEX_memory_copy(APEX_Memory* copy, const APEX_Memory* memory);
+
+void
+APEX_memory_free(APEX_Memory* memory);
+
+void
+APEX_units_reset(APEX_Unit_Config* units);
+
+int
+APEX_units_load(APEX_Unit_Config* units, const char* filename);
+
+APEX_Cache*
+APEX_cache_create(const char* spec);
+
+APEX_Cache*
+APEX_cache_copy(const APEX_Cache* cache);
+
+int
+APEX_cache_access(APEX_Cache* cache, long* events, int address, int write);
+
+int
+APEX_cpu_save(const APEX_CPU* cpu, const char* filename);
+
+int
+APEX_cpu_restore(APEX_CPU* cpu, const char* filename);
+
+int
+APEX_cpu_pipeline_empty(const APEX_CPU* cpu);
+
+int
+APEX_ooo_step(APEX_CPU* cpu);
+
+int
+APEX_ooo_empty(const APEX_CPU* cpu);
+
+int
+APEX_ooo_idle(const APEX_CPU* cpu);
+
+long
+APEX_cpu_fast_forward(APEX_CPU* cpu, long max_instructions, int stop_pc);
+
+long
+APEX_cpu_threaded_run(APEX_CPU* cpu, long max_instructions, int stop_pc);
+
+long
+APEX_cpu_jit_run(APEX_CPU* cpu, long max_instructions, int stop_pc);
+
+void
+APEX_cpu_jit_release(APEX_CPU* cpu);
+
+int
+APEX_batch_run(const char* manifest, int threads, FILE* out);
+
+int
+APEX_cpu_run(APEX_CPU* cpu, const char* cycle);
 
 void
 APEX_cpu_stop(APEX_CPU* cpu);
 
 int
-fetch(APEX_CPU* cpu, const char* command);
+get_code_index(int pc);
 
 int
-decode(APEX_CPU* cpu, const char* command);
+fetch(APEX_CPU* cpu);
 
 int
-execute(APEX_CPU* cpu, const char* command);
+decode(APEX_CPU* cpu);
 
 int
-memory(APEX_CPU* cpu, const char* command);
+execute1(APEX_CPU* cpu);
 
 int
-writeback(APEX_CPU* cpu, const char* command);
+execute2(APEX_CPU* cpu);
 
-int display_reg(APEX_CPU* cpu);
+int
+memory1(APEX_CPU* cpu);
 
-int display_mem(APEX_CPU* cpu);
+int
+memory2(APEX_CPU* cpu);
 
-int decodeMul(APEX_CPU* cpu,CPU_Stage* stage);
-    
-int decodeAddSub(APEX_CPU* cpu,CPU_Stage* stage);
-	
-int decodeLogicalOp(APEX_CPU* cpu,CPU_Stage* stage);
+int
+writeback(APEX_CPU* cpu);
+
+int
+fetch2(APEX_CPU* cpu);
 
-int decodeBZ(APEX_CPU* cpu,CPU_Stage* stage);
+int
+fetch3(APEX_CPU* cpu);
+
+int
+execute(APEX_CPU* cpu);
 
-int execMul(APEX_CPU* cpu,CPU_Stage* stage);
+int
+memory(APEX_CPU* cpu);
 
-int execArithmetic(APEX_CPU* cpu,CPU_Stage* stage);
+int
+APEX_cpu_set_pipeline(APEX_CPU* cpu, int depth);
 
-int execStoreLoad(APEX_CPU* cpu,CPU_Stage* stage);
+int
+APEX_cpu_check_build(const APEX_CPU* cpu);
 
-int memStoreLoad(APEX_CPU* cpu,CPU_Stage* stage);
+void
+APEX_print_stage(APEX_CPU* cpu, int id, CPU_Stage* stage);
 
-int wbArithmetic(APEX_CPU* cpu,CPU_Stage* stage);
+void
+APEX_print_latch(APEX_CPU* cpu, const char* name, CPU_Stage* stage);
+
+uint32_t
+APEX_cpu_code_checksum(const APEX_CPU* cpu);
+
+int
+APEX_trace_open(APEX_CPU* cpu, const char* filename);
+
+int
+APEX_trace_close(APEX_CPU* cpu);
+
+void
+APEX_trace_begin_cycle(struct APEX_Trace* trace, int clock);
+
+void
+APEX_trace_stage(struct APEX_Trace* trace, int id, const CPU_Stage* stage);
+
+void
+APEX_trace_end_cycle(struct APEX_Trace* trace);
+
+int display_reg(APEX_CPU* cpu);
+
+int display_mem(APEX_CPU* cpu);
 #endif
\ No newline at end of file
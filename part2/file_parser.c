@@ -32,87 +32,165 @@ get_num_from_string(char* buffer)
 }
 
 /*
- * This function is related to parsing input file
+ * Mnemonic and operand classes of every opcode, indexed by OPCODE_*
+ *
+ * Note : you can edit this table to add new instructions
+ */
+const APEX_Opcode_Info opcode_info[NUM_OPCODES] = {
+  [OPCODE_NONE] = { "", 0 },
+  [OPCODE_NOP] = { "NOP", 0 },
+  [OPCODE_MOVC] = { "MOVC", OPF_RD | OPF_IMM },
+  [OPCODE_ADD] = { "ADD", OPF_RD | OPF_RS1 | OPF_RS2 | OPF_SETS_ZF },
+  [OPCODE_ADDL] = { "ADDL", OPF_RD | OPF_RS1 | OPF_IMM },
+  [OPCODE_SUB] = { "SUB", OPF_RD | OPF_RS1 | OPF_RS2 | OPF_SETS_ZF },
+  [OPCODE_SUBL] = { "SUBL", OPF_RD | OPF_RS1 | OPF_IMM },
+  [OPCODE_MUL] = { "MUL", OPF_RD | OPF_RS1 | OPF_RS2 | OPF_SETS_ZF },
+  [OPCODE_AND] = { "AND", OPF_RD | OPF_RS1 | OPF_RS2 },
+  [OPCODE_OR] = { "OR", OPF_RD | OPF_RS1 | OPF_RS2 },
+  [OPCODE_EXOR] = { "EX-OR", OPF_RD | OPF_RS1 | OPF_RS2 },
+  [OPCODE_LOAD] = { "LOAD", OPF_RD | OPF_RS1 | OPF_IMM | OPF_MEM },
+  [OPCODE_STORE] = { "STORE", OPF_RS1 | OPF_RS2 | OPF_IMM | OPF_MEM },
+  [OPCODE_BZ] = { "BZ", OPF_IMM | OPF_BRANCH },
+  [OPCODE_BNZ] = { "BNZ", OPF_IMM | OPF_BRANCH },
+  [OPCODE_HALT] = { "HALT", 0 },
+};
+
+/*
+ * Maps a mnemonic onto its OPCODE_* value, OPCODE_NONE if unknown
+ */
+static int
+lookup_opcode(const char* mnemonic)
+{
+  for (int op = OPCODE_NONE + 1; op < NUM_OPCODES; ++op) {
+    if (strcmp(mnemonic, opcode_info[op].name) == 0) {
+      return op;
+    }
+  }
+  return OPCODE_NONE;
+}
+
+/*
+ * This function is related to parsing input file. It encodes one line into
+ * an instruction word and returns 0, or -1 if an operand does not fit its
+ * field.
  *
  * Note : you can edit this function to add new instructions
  */
-static void
-create_APEX_instruction(APEX_Instruction* ins, char* buffer)
+static int
+create_APEX_instruction(APEX_Instruction* ins, char* buffer, int line_num)
 {
-  char* token = strtok(buffer, ",");
+  char* saveptr;
+  char* token = strtok_r(buffer, ",", &saveptr);
   int token_num = 0;
-  char tokens[6][128];
-  while (token != NULL) {
-    strcpy(tokens[token_num], token);
+  char* tokens[6];
+  while (token != NULL && token_num < 6) {
+    tokens[token_num] = token;
     token_num++;
-    token = strtok(NULL, ",");
+    token = strtok_r(NULL, ",", &saveptr);
   }
 
-  strcpy(ins->opcode, tokens[0]);
-
-    if (strcmp(ins->opcode, "STORE") == 0) {
-    ins->rs1 = get_num_from_string(tokens[1]);
-    ins->rs2 = get_num_from_string(tokens[2]);
-    ins->imm = get_num_from_string(tokens[3]);
-  }
-  
-  if (strcmp(ins->opcode, "LOAD") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->imm = get_num_from_string(tokens[3]);
+  *ins = APEX_encode(OPCODE_NONE, 0, 0, 0, 0);
+  if (!token_num) {
+    return 0;
   }
-  
-  if (strcmp(ins->opcode, "MOVC") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->imm = get_num_from_string(tokens[2]);
-  }
-  
-  if (strcmp(ins->opcode, "ADD") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
-  }
-  
-   if (strcmp(ins->opcode, "SUB") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
-  }
-  
-  if (strcmp(ins->opcode, "AND") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
+
+  /* The last token on a line still carries the line terminator */
+  tokens[0][strcspn(tokens[0], " \t\r\n")] = '\0';
+  int opcode = lookup_opcode(tokens[0]);
+  if (opcode == OPCODE_NONE) {
+    fprintf(stderr,
+            "APEX_Parser : line %d: Unknown instruction '%s'\n",
+            line_num,
+            tokens[0]);
+    return 0;
   }
-  
-  if (strcmp(ins->opcode, "OR") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
+
+  /* Operands follow the mnemonic in the order rd, rs1, rs2, imm */
+  int flags = opcode_info[opcode].flags;
+  int operand[4] = { 0, 0, 0, 0 };
+  int next = 1;
+  for (int i = 0; i < 4; ++i) {
+    if ((flags & (OPF_RD << i)) && next < token_num) {
+      operand[i] = get_num_from_string(tokens[next++]);
+    }
   }
-  
-  if (strcmp(ins->opcode, "EX-OR") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
+
+  for (int i = 0; i < 3; ++i) {
+    if (operand[i] < 0 || operand[i] >= APEX_NUM_REGS) {
+      fprintf(stderr,
+              "APEX_Parser : line %d: Register R%d out of range\n",
+              line_num,
+              operand[i]);
+      return -1;
+    }
+  }
+  int imm_limit = 1 << (APEX_imm_bits(opcode) - 1);
+  if (operand[3] < -imm_limit || operand[3] >= imm_limit) {
+    fprintf(stderr,
+            "APEX_Parser : line %d: Literal #%d does not fit in %d bits\n",
+            line_num,
+            operand[3],
+            APEX_imm_bits(opcode));
+    return -1;
   }
-  
-  if (strcmp(ins->opcode, "MUL") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
+
+  *ins = APEX_encode(opcode, operand[0], operand[1], operand[2], operand[3]);
+  return 0;
+}
+
+/*
+ * Creates code memory from assembly text held in memory, one instruction
+ * per line
+ */
+APEX_Instruction*
+create_code_memory_from_buffer(const char* text, size_t length, int* size)
+{
+  char* copy = malloc(length + 1);
+  if (!copy) {
+    return NULL;
   }
-  
-  if (strcmp(ins->opcode, "BZ") == 0) {
-    ins->imm = get_num_from_string(tokens[1]);
+  memcpy(copy, text, length);
+  copy[length] = '\0';
+  length = strlen(copy);
+
+  int code_memory_size = 0;
+  for (size_t i = 0; i < length; ++i) {
+    if (copy[i] == '\n' || i == length - 1) {
+      code_memory_size++;
+    }
   }
-if (strcmp(ins->opcode, "HALT") == 0) {
-    ins->imm = get_num_from_string(tokens[1]);
+  *size = code_memory_size;
+  if (!code_memory_size) {
+    free(copy);
+    return NULL;
   }
 
+  APEX_Instruction* code_memory =
+    malloc(sizeof(*code_memory) * code_memory_size);
+  if (!code_memory) {
+    free(copy);
+    return NULL;
+  }
 
-  
+  char* line = copy;
+  for (int current_instruction = 0; current_instruction < code_memory_size;
+       ++current_instruction) {
+    char* end = strchr(line, '\n');
+    if (end) {
+      *end = '\0';
+    }
+    if (create_APEX_instruction(&code_memory[current_instruction],
+                                line,
+                                current_instruction + 1) < 0) {
+      free(code_memory);
+      code_memory = NULL;
+      break;
+    }
+    line = end ? end + 1 : line + strlen(line);
+  }
 
+  free(copy);
+  return code_memory;
 }
 
 /*
@@ -132,35 +210,29 @@ create_code_memory(const char* filename, int* size)
     return NULL;
   }
 
-  char* line = NULL;
-  size_t len = 0;
-  ssize_t nread;
-  int code_memory_size = 0;
-
-  while ((nread = getline(&line, &len, fp)) != -1) {
-    code_memory_size++;
-  }
-  *size = code_memory_size;
-  if (!code_memory_size) {
-    fclose(fp);
-    return NULL;
-  }
+  /* Read the whole file once and parse it from memory */
+  char* text = NULL;
+  size_t length = 0;
+  size_t capacity = 0;
+  size_t nread;
+  do {
+    if (length == capacity) {
+      capacity = capacity ? capacity * 2 : 4096;
+      char* grown = realloc(text, capacity);
+      if (!grown) {
+        free(text);
+        fclose(fp);
+        return NULL;
+      }
+      text = grown;
+    }
+    nread = fread(text + length, 1, capacity - length, fp);
+    length += nread;
+  } while (nread > 0);
+  fclose(fp);
 
   APEX_Instruction* code_memory =
-    malloc(sizeof(*code_memory) * code_memory_size);
-  if (!code_memory) {
-    fclose(fp);
-    return NULL;
-  }
-
-  rewind(fp);
-  int current_instruction = 0;
-  while ((nread = getline(&line, &len, fp)) != -1) {
-    create_APEX_instruction(&code_memory[current_instruction], line);
-    current_instruction++;
-  }
-
-  free(line);
-  fclose(fp);
+    create_code_memory_from_buffer(text, length, size);
+  free(text);
   return code_memory;
 }
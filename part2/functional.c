@@ -0,0 +1,129 @@
+/*
+ *  functional.c
+ *  Contains the functional model of APEX, which executes instructions
+ *  directly on the architectural state without modelling the pipeline
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+
+/*
+ * True if no instruction is in flight, so that the architectural state is
+ * all there is to the cpu
+ */
+int
+APEX_cpu_pipeline_empty(const APEX_CPU* cpu)
+{
+  if (!APEX_ooo_empty(cpu)) {
+    return 0;
+  }
+  for (int i = F; i < NUM_STAGES; ++i) {
+    for (int k = 0; k < APEX_MAX_WIDTH; ++k) {
+      int opcode = cpu->latches[i][k].opcode;
+      if (opcode != OPCODE_NONE && opcode != OPCODE_NOP) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/*
+ * Executes up to max_instructions instructions from cpu->pc without timing
+ * and returns how many were executed, or -1 if the pipeline still holds
+ * instructions. Execution stops early before the instruction at stop_pc
+ * (pass -1 for none), before a HALT, or when pc leaves code memory. The
+ * detailed pipeline then carries on from cpu->pc with the updated
+ * registers, zero flag and data memory.
+ */
+long
+APEX_cpu_fast_forward(APEX_CPU* cpu, long max_instructions, int stop_pc)
+{
+  if (!APEX_cpu_pipeline_empty(cpu)) {
+    return -1;
+  }
+
+  const APEX_Instruction* code = cpu->code_memory;
+  int* regs = cpu->regs;
+  int pc = cpu->pc;
+  int zero_flag = cpu->zero_flag;
+  long executed = 0;
+
+  while (executed < max_instructions && pc != stop_pc) {
+    int index = get_code_index(pc);
+    if (index < 0 || index >= cpu->code_memory_size) {
+      break;
+    }
+
+    APEX_Instruction ins = code[index];
+    int next_pc = pc + 4;
+    int result;
+    switch (APEX_opcode(ins)) {
+      case OPCODE_MOVC:
+        regs[APEX_rd(ins)] = APEX_imm(ins);
+        break;
+      case OPCODE_ADD:
+        result = regs[APEX_rs1(ins)] + regs[APEX_rs2(ins)];
+        regs[APEX_rd(ins)] = result;
+        zero_flag = (result == 0);
+        break;
+      case OPCODE_ADDL:
+        regs[APEX_rd(ins)] = regs[APEX_rs1(ins)] + APEX_imm(ins);
+        break;
+      case OPCODE_SUB:
+        result = regs[APEX_rs1(ins)] - regs[APEX_rs2(ins)];
+        regs[APEX_rd(ins)] = result;
+        zero_flag = (result == 0);
+        break;
+      case OPCODE_SUBL:
+        regs[APEX_rd(ins)] = regs[APEX_rs1(ins)] - APEX_imm(ins);
+        break;
+      case OPCODE_MUL:
+        result = regs[APEX_rs1(ins)] * regs[APEX_rs2(ins)];
+        regs[APEX_rd(ins)] = result;
+        zero_flag = (result == 0);
+        break;
+      case OPCODE_AND:
+        regs[APEX_rd(ins)] = regs[APEX_rs1(ins)] & regs[APEX_rs2(ins)];
+        break;
+      case OPCODE_OR:
+        regs[APEX_rd(ins)] = regs[APEX_rs1(ins)] | regs[APEX_rs2(ins)];
+        break;
+      case OPCODE_EXOR:
+        regs[APEX_rd(ins)] = regs[APEX_rs1(ins)] ^ regs[APEX_rs2(ins)];
+        break;
+      case OPCODE_LOAD:
+        regs[APEX_rd(ins)] =
+          APEX_mem_load(cpu, regs[APEX_rs1(ins)] + APEX_imm(ins));
+        break;
+      case OPCODE_STORE:
+        APEX_mem_store(
+          cpu, regs[APEX_rs2(ins)] + APEX_imm(ins), regs[APEX_rs1(ins)]);
+        break;
+      case OPCODE_BZ:
+        if (zero_flag) {
+          next_pc = APEX_branch_target(pc, APEX_imm(ins));
+        }
+        break;
+      case OPCODE_BNZ:
+        if (!zero_flag) {
+          next_pc = APEX_branch_target(pc, APEX_imm(ins));
+        }
+        break;
+      case OPCODE_HALT:
+        /* Left for the pipeline, which drains behind it */
+        goto done;
+      default:
+        break;
+    }
+    pc = next_pc;
+    executed++;
+  }
+
+done:
+  cpu->pc = pc;
+  cpu->zero_flag = zero_flag;
+  cpu->fast_forwarded += executed;
+  return executed;
+}
@@ -0,0 +1,507 @@
+/*
+ *  jit.c
+ *  Translates APEX basic blocks into x86-64 code for architectural-only
+ *  runs. Translated blocks keep regs, zero_flag and data memory in the
+ *  APEX_CPU, cached by the code memory index of their first instruction,
+ *  and jump directly into each other once both ends are translated. LOAD
+ *  and STORE access the hot page inline and call memory.c otherwise.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+
+#if defined(__x86_64__)
+
+#define JIT_CODE_SIZE (4 << 20)		// Bytes of translated code cached
+#define JIT_MAX_BLOCK 64		// Instructions per block at most
+#define JIT_MAX_BLOCK_BYTES (64 + JIT_MAX_BLOCK * 80)
+
+/* A translated block */
+typedef struct APEX_Jit_Block
+{
+  unsigned char* code;	// Entry point, NULL until translated
+  int length;		// Instructions executed by one pass
+} APEX_Jit_Block;
+
+/* A block exit not yet chained to its successor */
+typedef struct APEX_Jit_Exit
+{
+  unsigned char* site;	// jmp rel32 to patch
+  int next;		// Next pending exit to the same target, -1 at the end
+} APEX_Jit_Exit;
+
+/* Translation cache of one cpu */
+typedef struct APEX_Jit
+{
+  unsigned char* code;	// JIT_CODE_SIZE bytes, writable or executable
+  unsigned char* top;	// First free byte
+  unsigned char* exit_stub;	// Returns the pc in eax to the dispatcher
+  APEX_Jit_Block* blocks;	// Indexed by code memory index
+  int* pending;		// Head of the pending exits to each index
+  APEX_Jit_Exit* exits;
+  int num_exits;
+  int max_exits;
+} APEX_Jit;
+
+/* Enters translated code at block. Returns the pc execution stopped at and
+ * leaves the unused part of the budget in *budget.
+ */
+typedef int (*APEX_Jit_Enter)(APEX_CPU* cpu, long* budget, int stop_pc,
+                              void* block);
+
+static inline void
+emit8(APEX_Jit* jit, int byte)
+{
+  *jit->top++ = byte;
+}
+
+static inline void
+emit32(APEX_Jit* jit, uint32_t value)
+{
+  memcpy(jit->top, &value, sizeof(value));
+  jit->top += sizeof(value);
+}
+
+static inline void
+emit_bytes(APEX_Jit* jit, const char* bytes, int count)
+{
+  memcpy(jit->top, bytes, count);
+  jit->top += count;
+}
+
+/* op eax/ecx, [rbx + disp32] and friends, rbx holding the cpu */
+static inline void
+emit_rbx_disp(APEX_Jit* jit, const char* opcode, int opcode_len, int modrm,
+              size_t disp)
+{
+  emit_bytes(jit, opcode, opcode_len);
+  emit8(jit, modrm);
+  emit32(jit, disp);
+}
+
+#define REG(r) (offsetof(APEX_CPU, regs) + sizeof(int) * (r))
+#define ZERO_FLAG offsetof(APEX_CPU, zero_flag)
+#define MEMORY offsetof(APEX_CPU, memory)
+#define HOT_NUMBER offsetof(APEX_CPU, memory.hot_number)
+#define HOT_PAGE offsetof(APEX_CPU, memory.hot_page)
+
+static void
+load_eax(APEX_Jit* jit, int r)
+{
+  emit_rbx_disp(jit, "\x8b", 1, 0x83, REG(r));	// mov eax, [rbx+r]
+}
+
+static void
+store_eax(APEX_Jit* jit, int r)
+{
+  emit_rbx_disp(jit, "\x89", 1, 0x83, REG(r));	// mov [rbx+r], eax
+}
+
+/* zero_flag = (eax == 0) */
+static void
+set_zero_flag(APEX_Jit* jit)
+{
+  emit_bytes(jit, "\x85\xc0", 2);	// test eax, eax
+  emit_bytes(jit, "\x0f\x94\xc1", 3);	// sete cl
+  emit_bytes(jit, "\x0f\xb6\xc9", 3);	// movzx ecx, cl
+  emit_rbx_disp(jit, "\x89", 1, 0x8b, ZERO_FLAG);	// mov [rbx+zf], ecx
+}
+
+/* Address in eax, falls through if it lies in the hot page, otherwise jumps
+ * over the following skip bytes
+ */
+static void
+check_hot_page(APEX_Jit* jit, int skip)
+{
+  emit_bytes(jit, "\x89\xc2", 2);	// mov edx, eax
+  emit_bytes(jit, "\xc1\xea", 2);	// shr edx, APEX_PAGE_BITS
+  emit8(jit, APEX_PAGE_BITS);
+  emit_rbx_disp(jit, "\x3b", 1, 0x93, HOT_NUMBER);	// cmp edx, [hot]
+  emit8(jit, 0x75);	// jne skip
+  emit8(jit, skip);
+}
+
+/* Calls a memory.c access with the address in eax, the value to store in
+ * ecx. Entering translated code leaves the stack aligned for calls.
+ */
+static void
+call_memory(APEX_Jit* jit, const void* function, int store)
+{
+  uint64_t address = (uintptr_t)function;
+
+  emit_rbx_disp(jit, "\x48\x8d", 2, 0xbb, MEMORY);	// lea rdi, [memory]
+  emit_bytes(jit, "\x89\xc6", 2);	// mov esi, eax
+  if (store) {
+    emit_bytes(jit, "\x89\xca", 2);	// mov edx, ecx
+  }
+  emit_bytes(jit, "\x48\xb8", 2);	// mov rax, function
+  emit32(jit, (uint32_t)address);
+  emit32(jit, (uint32_t)(address >> 32));
+  emit_bytes(jit, "\xff\xd0", 2);	// call rax
+}
+
+/* Translates one non-branch instruction */
+static void
+emit_instruction(APEX_Jit* jit, APEX_Instruction ins)
+{
+  static const char alu[NUM_OPCODES] = {
+    [OPCODE_ADD] = 0x03, [OPCODE_SUB] = 0x2b, [OPCODE_AND] = 0x23,
+    [OPCODE_OR] = 0x0b,  [OPCODE_EXOR] = 0x33,
+  };
+  int opcode = APEX_opcode(ins);
+
+  switch (opcode) {
+    case OPCODE_MOVC:
+      emit_rbx_disp(jit, "\xc7", 1, 0x83, REG(APEX_rd(ins)));
+      emit32(jit, APEX_imm(ins));
+      break;
+    case OPCODE_ADD:
+    case OPCODE_SUB:
+    case OPCODE_AND:
+    case OPCODE_OR:
+    case OPCODE_EXOR:
+    case OPCODE_MUL:
+      load_eax(jit, APEX_rs1(ins));
+      if (opcode == OPCODE_MUL) {
+        emit_rbx_disp(jit, "\x0f\xaf", 2, 0x83, REG(APEX_rs2(ins)));
+      } else {
+        emit_rbx_disp(jit, &alu[opcode], 1, 0x83, REG(APEX_rs2(ins)));
+      }
+      store_eax(jit, APEX_rd(ins));
+      if (opcode_info[opcode].flags & OPF_SETS_ZF) {
+        set_zero_flag(jit);
+      }
+      break;
+    case OPCODE_ADDL:
+    case OPCODE_SUBL:
+      load_eax(jit, APEX_rs1(ins));
+      emit8(jit, opcode == OPCODE_ADDL ? 0x05 : 0x2d);	// add/sub eax, imm32
+      emit32(jit, APEX_imm(ins));
+      store_eax(jit, APEX_rd(ins));
+      break;
+    case OPCODE_LOAD:
+      load_eax(jit, APEX_rs1(ins));
+      emit8(jit, 0x05);	// add eax, imm32
+      emit32(jit, APEX_imm(ins));
+      check_hot_page(jit, 17);
+      emit_rbx_disp(jit, "\x48\x8b", 2, 0x8b, HOT_PAGE);	// mov rcx, [page]
+      emit8(jit, 0x25);	// and eax, APEX_PAGE_SIZE - 1
+      emit32(jit, APEX_PAGE_SIZE - 1);
+      emit_bytes(jit, "\x8b\x04\x81", 3);	// mov eax, [rcx+rax*4]
+      emit_bytes(jit, "\xeb\x15", 2);	// jmp over the call
+      call_memory(jit, APEX_memory_load, 0);
+      store_eax(jit, APEX_rd(ins));
+      break;
+    case OPCODE_STORE:
+      load_eax(jit, APEX_rs2(ins));
+      emit8(jit, 0x05);	// add eax, imm32
+      emit32(jit, APEX_imm(ins));
+      emit_rbx_disp(jit, "\x8b", 1, 0x8b, REG(APEX_rs1(ins)));	// mov ecx
+      check_hot_page(jit, 17);
+      emit_rbx_disp(jit, "\x48\x8b", 2, 0x93, HOT_PAGE);	// mov rdx, [page]
+      emit8(jit, 0x25);	// and eax, APEX_PAGE_SIZE - 1
+      emit32(jit, APEX_PAGE_SIZE - 1);
+      emit_bytes(jit, "\x89\x0c\x82", 3);	// mov [rdx+rax*4], ecx
+      emit_bytes(jit, "\xeb\x17", 2);	// jmp over the call
+      call_memory(jit, APEX_memory_store, 1);
+      break;
+    default:
+      break;
+  }
+}
+
+/* Points the jmp rel32 at site to target */
+static inline void
+patch_jump(unsigned char* site, unsigned char* target)
+{
+  int32_t rel = target - (site + 5);
+  memcpy(site + 1, &rel, sizeof(rel));
+}
+
+/* Leaves the block for pc: jumps straight into its translation if there is
+ * one, otherwise returns pc to the dispatcher and remembers the site so
+ * that it is chained once pc is translated
+ */
+static void
+emit_exit(APEX_Jit* jit, const APEX_CPU* cpu, int pc)
+{
+  emit8(jit, 0xb8);	// mov eax, pc
+  emit32(jit, pc);
+
+  unsigned char* site = jit->top;
+  emit8(jit, 0xe9);	// jmp rel32
+  emit32(jit, 0);
+  patch_jump(site, jit->exit_stub);
+
+  int index = get_code_index(pc);
+  if (index < 0 || index >= cpu->code_memory_size || pc % 4 != 0) {
+    return;
+  }
+  if (jit->blocks[index].code) {
+    patch_jump(site, jit->blocks[index].code);
+  } else if (jit->num_exits < jit->max_exits) {
+    APEX_Jit_Exit* exit = &jit->exits[jit->num_exits];
+    exit->site = site;
+    exit->next = jit->pending[index];
+    jit->pending[index] = jit->num_exits++;
+  }
+}
+
+/* Code shared by all blocks: the entry from C and the exit back to it */
+static void
+emit_stubs(APEX_Jit* jit)
+{
+  jit->top = jit->code;
+  emit_bytes(jit, "\x53\x41\x54\x41\x55\x56", 6);	// push rbx, r12, r13, rsi
+  emit_bytes(jit, "\x48\x83\xec\x08", 4);	// sub rsp, 8
+  emit_bytes(jit, "\x48\x89\xfb", 3);	// mov rbx, rdi
+  emit_bytes(jit, "\x4c\x8b\x26", 3);	// mov r12, [rsi]
+  emit_bytes(jit, "\x41\x89\xd5", 3);	// mov r13d, edx
+  emit_bytes(jit, "\xff\xe1", 2);	// jmp rcx
+
+  jit->exit_stub = jit->top;
+  emit_bytes(jit, "\x48\x83\xc4\x08", 4);	// add rsp, 8
+  emit_bytes(jit, "\x5e\x4c\x89\x26", 4);	// pop rsi, mov [rsi], r12
+  emit_bytes(jit, "\x41\x5d\x41\x5c\x5b\xc3", 6);	// pop r13, r12, rbx, ret
+}
+
+/* Drops every translation */
+static void
+flush(APEX_Jit* jit, int code_memory_size)
+{
+  memset(jit->blocks, 0, sizeof(*jit->blocks) * code_memory_size);
+  for (int i = 0; i < code_memory_size; ++i) {
+    jit->pending[i] = -1;
+  }
+  jit->num_exits = 0;
+  emit_stubs(jit);
+}
+
+/*
+ * Translates the block starting at index. A block ends after a branch,
+ * before a HALT, at the end of code memory or after JIT_MAX_BLOCK
+ * instructions.
+ */
+static APEX_Jit_Block*
+translate(APEX_Jit* jit, const APEX_CPU* cpu, int index)
+{
+  if (jit->code + JIT_CODE_SIZE - jit->top < JIT_MAX_BLOCK_BYTES) {
+    flush(jit, cpu->code_memory_size);
+  }
+
+  int start_pc = 4000 + index * 4;
+  int length = 0;
+  while (length < JIT_MAX_BLOCK && index + length < cpu->code_memory_size) {
+    int opcode = APEX_opcode(cpu->code_memory[index + length]);
+    if (opcode == OPCODE_HALT) {
+      break;
+    }
+    length++;
+    if (opcode_info[opcode].flags & OPF_BRANCH) {
+      break;
+    }
+  }
+
+  APEX_Jit_Block* block = &jit->blocks[index];
+  block->code = jit->top;
+  block->length = length;
+
+  /* Return to the dispatcher unless the whole block fits the budget and
+   * stop_pc lies outside of it
+   */
+  emit_bytes(jit, "\x49\x81\xfc", 3);	// cmp r12, length
+  emit32(jit, length);
+  emit_bytes(jit, "\x0f\x8c", 2);	// jl bail
+  unsigned char* bail_short = jit->top;
+  emit32(jit, 0);
+  emit_bytes(jit, "\x44\x89\xe8", 3);	// mov eax, r13d
+  emit8(jit, 0x2d);	// sub eax, start_pc
+  emit32(jit, start_pc);
+  emit8(jit, 0x3d);	// cmp eax, 4 * length
+  emit32(jit, 4 * length);
+  emit_bytes(jit, "\x0f\x82", 2);	// jb bail
+  unsigned char* bail_stop = jit->top;
+  emit32(jit, 0);
+  emit_bytes(jit, "\x49\x81\xec", 3);	// sub r12, length
+  emit32(jit, length);
+
+  for (int i = 0; i < length; ++i) {
+    emit_instruction(jit, cpu->code_memory[index + i]);
+  }
+
+  int end_pc = start_pc + 4 * length;
+  APEX_Instruction last = cpu->code_memory[index + length - 1];
+  if (opcode_info[APEX_opcode(last)].flags & OPF_BRANCH) {
+    emit_rbx_disp(jit, "\x83", 1, 0xbb, ZERO_FLAG);	// cmp dword [zf], 0
+    emit8(jit, 0);
+    emit8(jit, 0x0f);	// jne/je taken
+    emit8(jit, APEX_opcode(last) == OPCODE_BZ ? 0x85 : 0x84);
+    unsigned char* taken = jit->top;
+    emit32(jit, 0);
+    emit_exit(jit, cpu, end_pc);
+    int32_t rel = jit->top - (taken + 4);
+    memcpy(taken, &rel, sizeof(rel));
+    emit_exit(jit, cpu, APEX_branch_target(end_pc - 4, APEX_imm(last)));
+  } else {
+    emit_exit(jit, cpu, end_pc);
+  }
+
+  /* bail: mov eax, start_pc; jmp exit_stub */
+  int32_t rel = jit->top - (bail_short + 4);
+  memcpy(bail_short, &rel, sizeof(rel));
+  rel = jit->top - (bail_stop + 4);
+  memcpy(bail_stop, &rel, sizeof(rel));
+  emit8(jit, 0xb8);
+  emit32(jit, start_pc);
+  emit8(jit, 0xe9);
+  emit32(jit, jit->exit_stub - (jit->top + 4));
+
+  /* Chain the exits that were waiting for this block */
+  for (int e = jit->pending[index]; e >= 0; e = jit->exits[e].next) {
+    patch_jump(jit->exits[e].site, block->code);
+  }
+  jit->pending[index] = -1;
+  return block;
+}
+
+static APEX_Jit*
+create_jit(const APEX_CPU* cpu)
+{
+  APEX_Jit* jit = calloc(1, sizeof(*jit));
+  if (!jit) {
+    return NULL;
+  }
+
+  jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  jit->blocks = malloc(sizeof(*jit->blocks) * cpu->code_memory_size);
+  jit->pending = malloc(sizeof(*jit->pending) * cpu->code_memory_size);
+  jit->max_exits = 2 * cpu->code_memory_size;
+  jit->exits = malloc(sizeof(*jit->exits) * jit->max_exits);
+  if (jit->code == MAP_FAILED || !jit->blocks || !jit->pending ||
+      !jit->exits) {
+    if (jit->code != MAP_FAILED) {
+      munmap(jit->code, JIT_CODE_SIZE);
+    }
+    free(jit->blocks);
+    free(jit->pending);
+    free(jit->exits);
+    free(jit);
+    return NULL;
+  }
+
+  flush(jit, cpu->code_memory_size);
+  return jit;
+}
+
+void
+APEX_cpu_jit_release(APEX_CPU* cpu)
+{
+  APEX_Jit* jit = cpu->jit;
+  if (!jit) {
+    return;
+  }
+  munmap(jit->code, JIT_CODE_SIZE);
+  free(jit->blocks);
+  free(jit->pending);
+  free(jit->exits);
+  free(jit);
+  cpu->jit = NULL;
+}
+
+/*
+ * Same contract as APEX_cpu_fast_forward, executing translated blocks. The
+ * parts of a block beyond the budget or stop_pc are interpreted, and so is
+ * the rest of the run if the host refuses to make the code executable.
+ */
+long
+APEX_cpu_jit_run(APEX_CPU* cpu, long max_instructions, int stop_pc)
+{
+  if (!APEX_cpu_pipeline_empty(cpu)) {
+    return -1;
+  }
+  if (!cpu->jit) {
+    cpu->jit = create_jit(cpu);
+    if (!cpu->jit) {
+      return APEX_cpu_fast_forward(cpu, max_instructions, stop_pc);
+    }
+  }
+
+  APEX_Jit* jit = cpu->jit;
+  int writable = 1;
+  long executed = 0;
+  while (executed < max_instructions && cpu->pc != stop_pc) {
+    int index = get_code_index(cpu->pc);
+    if (index < 0 || index >= cpu->code_memory_size ||
+        APEX_opcode(cpu->code_memory[index]) == OPCODE_HALT) {
+      break;
+    }
+
+    /* Code is either writable or executable, never both */
+    APEX_Jit_Block* block = &jit->blocks[index];
+    if (!block->code) {
+      if (!writable) {
+        if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+          goto refused;
+        }
+        writable = 1;
+      }
+      block = translate(jit, cpu, index);
+    }
+
+    long budget = max_instructions - executed;
+    if (budget < block->length ||
+        (unsigned)(stop_pc - cpu->pc) < 4u * block->length) {
+      long stepped = APEX_cpu_fast_forward(
+        cpu, budget < block->length ? budget : block->length, stop_pc);
+      executed += stepped;
+      if (stepped == 0) {
+        break;
+      }
+      continue;
+    }
+
+    if (writable) {
+      if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        goto refused;
+      }
+      writable = 0;
+    }
+    long remaining = budget;
+    cpu->pc = ((APEX_Jit_Enter)jit->code)(cpu, &remaining, stop_pc,
+                                          block->code);
+    cpu->fast_forwarded += budget - remaining;
+    executed += budget - remaining;
+  }
+
+  if (!writable &&
+      mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+    goto refused;
+  }
+  return executed;
+
+refused:
+  APEX_cpu_jit_release(cpu);
+  return executed + APEX_cpu_fast_forward(cpu, max_instructions - executed,
+                                          stop_pc);
+}
+
+#else
+
+/* No translator for this host, the functional model does the work */
+void
+APEX_cpu_jit_release(APEX_CPU* cpu)
+{
+}
+
+long
+APEX_cpu_jit_run(APEX_CPU* cpu, long max_instructions, int stop_pc)
+{
+  return APEX_cpu_fast_forward(cpu, max_instructions, stop_pc);
+}
+
+#endif
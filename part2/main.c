@@ -5,26 +5,295 @@
  * Hitesh Nikam (hnikam1@binghamton.edu)
  *  State University of New York, Binghamton
  */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cpu.h"
 
+/* A second cpu that continues the program of cpu on the out-of-order core,
+ * from the architectural state cpu has with its pipeline empty
+ */
+static APEX_CPU*
+out_of_order_twin(const APEX_CPU* cpu, const char* filename)
+{
+  APEX_CPU* twin = APEX_cpu_load(filename);
+  if (!twin) {
+    return NULL;
+  }
+
+  if (APEX_memory_copy(&twin->memory, &cpu->memory) != 0) {
+    APEX_cpu_stop(twin);
+    return NULL;
+  }
+  memcpy(twin->regs, cpu->regs, sizeof(twin->regs));
+  twin->zero_flag = cpu->zero_flag;
+  twin->pc = cpu->pc;
+  twin->core = APEX_CORE_OOO;
+  twin->predictor.kind = cpu->predictor.kind;
+  memcpy(twin->units, cpu->units, sizeof(twin->units));
+  return twin;
+}
+
+/* Instructions per cycle while the program was running */
+static double
+active_ipc(const APEX_CPU* cpu)
+{
+  long active = cpu->clock - cpu->counters.idle;
+  return active ? (double)cpu->counters.committed / active : 0.0;
+}
+
 int
 main(int argc, char const* argv[])
 {
-  if (argc != 4) {
-    fprintf(stderr, "APEX_Help : Usage %s <input_file>\n", argv[0]);
+  if (argc >= 3 && strcmp(argv[1], "--batch") == 0) {
+    int threads = argc > 3 ? atoi(argv[3]) : 0;
+    return APEX_batch_run(argv[2], threads, stdout) == 0 ? 0 : 1;
+  }
+
+  /* Options after the cycle count */
+  long fast_forward = 0;
+  int fast_forward_pc = -1;
+  long (*engine)(APEX_CPU*, long, int) = APEX_cpu_fast_forward;
+  const char* restore_file = NULL;
+  const char* save_file = NULL;
+  const char* trace_file = NULL;
+  const char* report_file = NULL;
+  int forwarding = APEX_START_FORWARDING;
+  int predictor = APEX_START_PREDICTOR;
+  int core = APEX_CORE_INORDER;
+  int compare_cores = 0;
+  int width = APEX_START_WIDTH;
+  int depth = APEX_START_DEPTH;
+  const char* dcache_spec = NULL;
+  const char* icache_spec = NULL;
+  int fetch_buffer_size = 8;
+  unsigned long long memory_size = APEX_DATA_MEMORY_SIZE;
+  int store_queue_size = 0;
+  const char* units_file = NULL;
+  int bad_option = 0;
+  int verbosity = argc >= 4 ? APEX_verbosity_from_command(argv[2]) : -1;
+  for (int i = 4; i < argc; ++i) {
+    if (strncmp(argv[i], "--fast-forward=", 15) == 0) {
+      fast_forward = atol(argv[i] + 15);
+    } else if (strncmp(argv[i], "--fast-forward-pc=", 18) == 0) {
+      fast_forward_pc = atoi(argv[i] + 18);
+    } else if (strcmp(argv[i], "--engine=interp") == 0) {
+      engine = APEX_cpu_fast_forward;
+    } else if (strcmp(argv[i], "--engine=threaded") == 0) {
+      engine = APEX_cpu_threaded_run;
+    } else if (strcmp(argv[i], "--engine=jit") == 0) {
+      engine = APEX_cpu_jit_run;
+    } else if (strncmp(argv[i], "--restore=", 10) == 0) {
+      restore_file = argv[i] + 10;
+    } else if (strncmp(argv[i], "--save=", 7) == 0) {
+      save_file = argv[i] + 7;
+    } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+      trace_file = argv[i] + 8;
+    } else if (strcmp(argv[i], "--forward=none") == 0) {
+      forwarding = 0;
+    } else if (strcmp(argv[i], "--forward=alu") == 0) {
+      forwarding = APEX_FORWARD_ALU;
+    } else if (strcmp(argv[i], "--forward=load") == 0) {
+      forwarding = APEX_FORWARD_LOAD;
+    } else if (strcmp(argv[i], "--forward=all") == 0) {
+      forwarding = APEX_FORWARD_ALL;
+    } else if (strncmp(argv[i], "--predict=", 10) == 0) {
+      predictor = APEX_predictor_kind(argv[i] + 10);
+      bad_option |= predictor < 0;
+    } else if (strcmp(argv[i], "--core=inorder") == 0) {
+      core = APEX_CORE_INORDER;
+    } else if (strcmp(argv[i], "--core=ooo") == 0) {
+      core = APEX_CORE_OOO;
+    } else if (strcmp(argv[i], "--core=both") == 0) {
+      core = APEX_CORE_INORDER;
+      compare_cores = 1;
+    } else if (strncmp(argv[i], "--width=", 8) == 0) {
+      width = atoi(argv[i] + 8);
+      bad_option |= width != 1 && width != 2 && width != 4;
+    } else if (strncmp(argv[i], "--depth=", 8) == 0) {
+      depth = atoi(argv[i] + 8);
+      bad_option |= depth != 5 && depth != 7 && depth != 9;
+    } else if (strcmp(argv[i], "--dcache") == 0) {
+      dcache_spec = "";
+    } else if (strncmp(argv[i], "--dcache=", 9) == 0) {
+      dcache_spec = argv[i] + 9;
+    } else if (strcmp(argv[i], "--icache") == 0) {
+      icache_spec = "";
+    } else if (strncmp(argv[i], "--icache=", 9) == 0) {
+      icache_spec = argv[i] + 9;
+    } else if (strncmp(argv[i], "--fetch-buffer=", 15) == 0) {
+      fetch_buffer_size = atoi(argv[i] + 15);
+      bad_option |= fetch_buffer_size < 1 ||
+                    fetch_buffer_size > APEX_FETCH_BUFFER_MAX;
+    } else if (strncmp(argv[i], "--units=", 8) == 0) {
+      units_file = argv[i] + 8;
+    } else if (strncmp(argv[i], "--store-queue=", 14) == 0) {
+      store_queue_size = atoi(argv[i] + 14);
+      bad_option |= store_queue_size < 1 ||
+                    store_queue_size > APEX_STORE_QUEUE_MAX;
+    } else if (strncmp(argv[i], "--memory=", 9) == 0) {
+      memory_size = strtoull(argv[i] + 9, NULL, 10);
+      bad_option |= memory_size == 0 || memory_size > (1ull << 32) ||
+                    memory_size % APEX_PAGE_SIZE != 0;
+    } else if (strncmp(argv[i], "--report=", 9) == 0) {
+      report_file = argv[i] + 9;
+    } else {
+      bad_option = 1;
+    }
+  }
+
+  if (argc < 4 || bad_option || verbosity < 0) {
+    fprintf(stderr,
+            "APEX_Help : Usage %s <input_file> <command> <cycles>\n"
+            "                  [--fast-forward=<instructions>]"
+            " [--fast-forward-pc=<pc>]\n"
+            "                  [--engine=interp|threaded|jit]"
+            " [--forward=none|alu|load|all]\n"
+            "                  [--predict=none|static|bimodal|gshare]"
+            " [--core=inorder|ooo|both]\n"
+            "                  [--width=1|2|4] [--dcache[=<key>=<value>,...]]\n"
+            "                  [--icache[=<key>=<value>,...]]"
+            " [--fetch-buffer=<instructions>]\n"
+            "                  [--store-queue=<entries>] [--memory=<words>]\n"
+            "                  [--units=<units_file>] [--depth=5|7|9]\n"
+            "                  [--restore=<snapshot>] [--save=<snapshot>]\n"
+            "                  [--trace=<trace_file>]"
+            " [--report=<json_file>|-]\n"
+            "            %s --batch <manifest> [threads]\n"
+            "           <command> is silent, simulate (registers only),"
+            " cycle or display\n",
+            argv[0],
+            argv[0]);
+    exit(1);
+  }
+
+  /* Traces and snapshots hold the latches of the in-order pipeline */
+  if ((core != APEX_CORE_INORDER || compare_cores) &&
+      (trace_file || restore_file)) {
+    fprintf(stderr,
+            "APEX_Error : --trace and --restore need --core=inorder\n");
+    exit(1);
+  }
+  if (trace_file && width != 1) {
+    fprintf(stderr, "APEX_Error : --trace needs --width=1\n");
     exit(1);
   }
 
-  APEX_CPU* cpu = APEX_cpu_init(argv[1]);
+  /* The trace takes the place of the printed pipeline view */
+  if (trace_file && verbosity > APEX_VERBOSITY_SUMMARY) {
+    verbosity = APEX_VERBOSITY_SUMMARY;
+  }
+
+  /* Everything the cpu prints leaves in large blocks */
+  setvbuf(stdout, NULL, _IOFBF, APEX_OUTPUT_BUFFER_SIZE);
+
+  APEX_CPU* cpu = APEX_cpu_init(argv[1], verbosity);
   if (!cpu) {
     fprintf(stderr, "APEX_Error : Unable to initialize CPU\n");
     exit(1);
   }
 
-  APEX_cpu_run(cpu,argv[2],argv[3]);
+  cpu->forwarding = forwarding;
+  cpu->predictor.kind = predictor;
+  cpu->core = core;
+  cpu->width = width;
+  APEX_cpu_set_pipeline(cpu, depth);
+  cpu->fetch_buffer_size = fetch_buffer_size;
+  cpu->memory.size = memory_size;
+  cpu->store_queue.size = store_queue_size;
+  if ((units_file && APEX_units_load(cpu->units, units_file) != 0) ||
+      APEX_cpu_check_build(cpu) != 0) {
+    APEX_cpu_stop(cpu);
+    exit(1);
+  }
+  if (dcache_spec && !(cpu->dcache = APEX_cache_create(dcache_spec))) {
+    fprintf(stderr, "APEX_Error : Bad data cache configuration %s\n",
+            dcache_spec);
+    APEX_cpu_stop(cpu);
+    exit(1);
+  }
+  if (icache_spec && !(cpu->icache = APEX_cache_create(icache_spec))) {
+    fprintf(stderr, "APEX_Error : Bad instruction cache configuration %s\n",
+            icache_spec);
+    APEX_cpu_stop(cpu);
+    exit(1);
+  }
+
+  if (restore_file && APEX_cpu_restore(cpu, restore_file) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to restore %s\n", restore_file);
+    APEX_cpu_stop(cpu);
+    exit(1);
+  }
+
+  /* Skip to the region of interest without simulating the pipeline. A PC
+   * alone runs until that PC is reached.
+   */
+  if (fast_forward > 0 || fast_forward_pc >= 0) {
+    long max_instructions = fast_forward > 0 ? fast_forward : LONG_MAX;
+    long executed = engine(cpu, max_instructions, fast_forward_pc);
+    if (verbosity >= APEX_VERBOSITY_SUMMARY) {
+      fprintf(stderr,
+              "APEX_CPU : Fast-forwarded %ld instructions to pc(%d)\n",
+              executed,
+              cpu->pc);
+    }
+  }
+
+  APEX_CPU* twin = NULL;
+  if (compare_cores) {
+    twin = out_of_order_twin(cpu, argv[1]);
+    if (!twin) {
+      fprintf(stderr, "APEX_Error : Unable to initialize CPU\n");
+      APEX_cpu_stop(cpu);
+      exit(1);
+    }
+  }
+
+  if (trace_file) {
+    if (APEX_trace_open(cpu, trace_file) != 0) {
+      fprintf(stderr, "APEX_Error : Unable to trace to %s\n", trace_file);
+      APEX_cpu_stop(cpu);
+      exit(1);
+    }
+  }
+
+  /* Counters are reported as JSON, "-" puts them after the output */
+  if (report_file) {
+    cpu->report =
+      strcmp(report_file, "-") == 0 ? stdout : fopen(report_file, "w");
+    if (!cpu->report) {
+      fprintf(stderr, "APEX_Error : Unable to write %s\n", report_file);
+      APEX_cpu_stop(cpu);
+      exit(1);
+    }
+  }
+
+  APEX_cpu_run(cpu,argv[3]);
+  if (cpu->report && cpu->report != stdout && fclose(cpu->report) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", report_file);
+  }
+  cpu->report = NULL;
+
+  /* Both cores run the same cycles from the same point */
+  if (twin) {
+    APEX_cpu_run_cycles(twin, atoi(argv[3]));
+    if (verbosity >= APEX_VERBOSITY_SUMMARY) {
+      fprintf(stderr,
+              "APEX_CPU : IPC in-order %.4f (%ld instructions),"
+              " out-of-order %.4f (%ld instructions)\n",
+              active_ipc(cpu), cpu->counters.committed, active_ipc(twin),
+              twin->counters.committed);
+    }
+    APEX_cpu_stop(twin);
+  }
+  if (trace_file && APEX_trace_close(cpu) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", trace_file);
+  }
+  if (save_file && APEX_cpu_save(cpu, save_file) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to save %s\n", save_file);
+  }
   APEX_cpu_stop(cpu);
   return 0;
 }
\ No newline at end of file
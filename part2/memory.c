@@ -0,0 +1,179 @@
+/*
+ *  memory.c
+ *  Sparse data memory of an APEX cpu: a two-level table of pages that are
+ *  allocated on first store, and the accesses that miss the hot page
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#define TABLE_SIZE (1 << APEX_TABLE_BITS)
+
+/*
+ * Puts memory in its reset state, size words that all read as 0
+ */
+void
+APEX_memory_init(APEX_Memory* memory, uint64_t size)
+{
+  memory->size = size;
+  memory->root = NULL;
+  memory->root_size = 0;
+  memory->pages = 0;
+  memory->hot_number = APEX_NO_PAGE;
+  memory->hot_page = NULL;
+}
+
+/* Grows the root to hold entry index, doubling it up to the tables data
+ * memory needs. Returns 0 on success.
+ */
+static int
+grow_root(APEX_Memory* memory, uint32_t index)
+{
+  uint64_t pages = (memory->size + APEX_PAGE_SIZE - 1) >> APEX_PAGE_BITS;
+  uint32_t limit = (pages + TABLE_SIZE - 1) >> APEX_TABLE_BITS;
+  uint32_t size = memory->root_size ? memory->root_size : 1;
+  while (size <= index) {
+    size *= 2;
+  }
+  if (size > limit) {
+    size = limit > index ? limit : index + 1;
+  }
+
+  int*** root = realloc(memory->root, sizeof(*root) * size);
+  if (!root) {
+    return -1;
+  }
+  memset(root + memory->root_size, 0,
+         sizeof(*root) * (size - memory->root_size));
+  memory->root = root;
+  memory->root_size = size;
+  return 0;
+}
+
+/*
+ * Finds page number, allocating it and its table if allocate is set.
+ * Returns NULL for a page that is not there or cannot be allocated.
+ */
+int*
+APEX_memory_page(APEX_Memory* memory, uint32_t number, int allocate)
+{
+  uint32_t index = number >> APEX_TABLE_BITS;
+  if (index >= memory->root_size) {
+    if (!allocate || grow_root(memory, index) != 0) {
+      return NULL;
+    }
+  }
+
+  int*** table = &memory->root[index];
+  if (!*table) {
+    if (!allocate) {
+      return NULL;
+    }
+    *table = calloc(TABLE_SIZE, sizeof(**table));
+    if (!*table) {
+      return NULL;
+    }
+  }
+
+  int** page = &(*table)[number & (TABLE_SIZE - 1)];
+  if (!*page && allocate) {
+    *page = calloc(APEX_PAGE_SIZE, sizeof(int));
+    memory->pages += *page != NULL;
+  }
+  return *page;
+}
+
+/*
+ * Number of the first allocated page from number on, APEX_NO_PAGE if there
+ * is none. Missing tables are skipped whole.
+ */
+uint32_t
+APEX_memory_next_page(const APEX_Memory* memory, uint32_t number)
+{
+  for (uint64_t n = number; n < (uint64_t)memory->root_size * TABLE_SIZE;) {
+    int** table = memory->root[n >> APEX_TABLE_BITS];
+    if (!table) {
+      n = ((n >> APEX_TABLE_BITS) + 1) << APEX_TABLE_BITS;
+    } else if (!table[n & (TABLE_SIZE - 1)]) {
+      n++;
+    } else {
+      return n;
+    }
+  }
+  return APEX_NO_PAGE;
+}
+
+/* Load that missed the hot page */
+int
+APEX_memory_load(APEX_Memory* memory, uint32_t address)
+{
+  if (address >= memory->size) {
+    return 0;
+  }
+  int* page = APEX_memory_page(memory, address >> APEX_PAGE_BITS, 0);
+  if (!page) {
+    return 0;
+  }
+  memory->hot_number = address >> APEX_PAGE_BITS;
+  memory->hot_page = page;
+  return page[address & (APEX_PAGE_SIZE - 1)];
+}
+
+/* Store that missed the hot page */
+void
+APEX_memory_store(APEX_Memory* memory, uint32_t address, int value)
+{
+  if (address >= memory->size) {
+    return;
+  }
+  int* page = APEX_memory_page(memory, address >> APEX_PAGE_BITS, 1);
+  if (!page) {
+    fprintf(stderr, "APEX_Memory : Out of memory, store to %u is lost\n",
+            address);
+    return;
+  }
+  memory->hot_number = address >> APEX_PAGE_BITS;
+  memory->hot_page = page;
+  page[address & (APEX_PAGE_SIZE - 1)] = value;
+}
+
+/*
+ * Makes copy an independent duplicate of memory, overwriting it without
+ * freeing what it held. Returns 0 on success; on failure copy is empty.
+ */
+int
+APEX_memory_copy(APEX_Memory* copy, const APEX_Memory* memory)
+{
+  APEX_memory_init(copy, memory->size);
+  for (uint32_t n = APEX_memory_next_page(memory, 0); n != APEX_NO_PAGE;
+       n = APEX_memory_next_page(memory, n + 1)) {
+    int* page = APEX_memory_page(copy, n, 1);
+    if (!page) {
+      APEX_memory_free(copy);
+      return -1;
+    }
+    memcpy(page, memory->root[n >> APEX_TABLE_BITS][n & (TABLE_SIZE - 1)],
+           sizeof(int) * APEX_PAGE_SIZE);
+  }
+  return 0;
+}
+
+/*
+ * Releases every page, leaving memory empty with its size
+ */
+void
+APEX_memory_free(APEX_Memory* memory)
+{
+  for (uint32_t i = 0; i < memory->root_size; ++i) {
+    if (memory->root[i]) {
+      for (int k = 0; k < TABLE_SIZE; ++k) {
+        free(memory->root[i][k]);
+      }
+      free(memory->root[i]);
+    }
+  }
+  free(memory->root);
+  APEX_memory_init(memory, memory->size);
+}
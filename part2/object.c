@@ -0,0 +1,129 @@
+/*
+ *  object.c
+ *  Contains functions to write and map binary APEX object files, which hold
+ *  already encoded instruction words so that loading needs no parsing
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+/*
+ * Returns 1 if the file starts with the object file magic
+ */
+int
+is_object_file(const char* filename)
+{
+  char magic[4];
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    return 0;
+  }
+
+  int found = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+              memcmp(magic, APEX_OBJECT_MAGIC, sizeof(magic)) == 0;
+  fclose(fp);
+  return found;
+}
+
+/*
+ * Validates the image of an object file and returns its instruction words,
+ * or NULL if the image is not a valid object or holds an unknown opcode
+ */
+const APEX_Instruction*
+object_image_code(const void* image, size_t image_size, int* size)
+{
+  const APEX_Object_Header* header = image;
+  if (image_size < sizeof(*header) ||
+      memcmp(header->magic, APEX_OBJECT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != APEX_OBJECT_VERSION ||
+      header->header_size < sizeof(*header) ||
+      header->header_size % sizeof(APEX_Instruction) != 0 ||
+      header->header_size > image_size || header->count == 0 ||
+      header->count >
+        (image_size - header->header_size) / sizeof(APEX_Instruction)) {
+    return NULL;
+  }
+
+  const APEX_Instruction* code =
+    (const APEX_Instruction*)((const char*)image + header->header_size);
+  for (uint32_t i = 0; i < header->count; ++i) {
+    if (APEX_opcode(code[i]) >= NUM_OPCODES) {
+      return NULL;
+    }
+  }
+
+  *size = header->count;
+  return code;
+}
+
+/*
+ * Maps an object file read-only and returns its instruction words, which
+ * serve as code memory as they are. The mapping must be released with
+ * munmap(*mapping, *mapping_size).
+ */
+const APEX_Instruction*
+map_object_file(const char* filename, int* size, void** mapping,
+                size_t* mapping_size)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(APEX_Object_Header)) {
+    close(fd);
+    return NULL;
+  }
+
+  void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+
+  const APEX_Instruction* code = object_image_code(base, st.st_size, size);
+  if (!code) {
+    fprintf(stderr, "APEX_Object : %s is not a valid object file\n", filename);
+    munmap(base, st.st_size);
+    return NULL;
+  }
+
+  /* Code memory is read from start to end as the program runs */
+  madvise(base, st.st_size, MADV_WILLNEED);
+
+  *mapping = base;
+  *mapping_size = st.st_size;
+  return code;
+}
+
+/*
+ * Writes encoded code memory as an object file, returns 0 on success
+ */
+int
+write_object_file(const char* filename, const APEX_Instruction* code, int size)
+{
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    return -1;
+  }
+
+  APEX_Object_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, APEX_OBJECT_MAGIC, sizeof(header.magic));
+  header.version = APEX_OBJECT_VERSION;
+  header.header_size = sizeof(header);
+  header.count = size;
+
+  int failed = fwrite(&header, sizeof(header), 1, fp) != 1 ||
+               fwrite(code, sizeof(*code), size, fp) != (size_t)size;
+  if (fclose(fp) != 0) {
+    failed = 1;
+  }
+  return failed ? -1 : 0;
+}
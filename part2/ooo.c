@@ -0,0 +1,581 @@
+/*
+ *  ooo.c
+ *  Out-of-order core model, an alternative to the in-order pipeline of
+ *  cpu.c running the same programs. Instructions are fetched and renamed
+ *  in order onto a physical register file, wait in reservation stations
+ *  until their operands are produced, execute out of order and commit in
+ *  order from a reorder buffer. Loads and stores go through a load/store
+ *  queue, stores write data memory when they commit.
+ *
+ *  The committed state lives in the APEX_CPU: regs, zero_flag, pc and
+ *  data memory always hold the state after the last committed instruction.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#define OOO_ROB_SIZE 32		// Reorder buffer entries
+#define OOO_RS_SIZE 16		// Reservation stations
+#define OOO_LSQ_SIZE 8		// Load/store queue entries
+
+/* The zero flag is renamed like a register. Its physical register holds the
+ * result that set it, the flag is set when that result is 0.
+ */
+#define OOO_ZF APEX_NUM_REGS
+#define OOO_ARCH_REGS (APEX_NUM_REGS + 1)
+
+/* Every instruction in flight holds at most a result and a flag register */
+#define OOO_PHYS_REGS (OOO_ARCH_REGS + 2 * OOO_ROB_SIZE)
+
+/* Cycles of data memory after address generation, which takes the memory
+ * unit's latency
+ */
+#define OOO_LOAD_MEMORY_LATENCY 1
+
+/* Reorder buffer entry, one per instruction in flight */
+typedef struct OOO_Rob_Entry
+{
+  int pc;
+  int index;		// Code memory index of the instruction
+  int opcode;
+  int rd;		// Architectural destination, -1 for none
+  int phys;		// Physical register renamed to rd
+  int old_phys;		// Previous mapping of rd, freed at commit
+  int flag_phys;	// Physical zero flag written, -1 for none
+  int old_flag_phys;
+  int rs;		// Reservation station, -1 once completed
+  int lsq;		// Load/store queue entry, -1 for none
+  int done;
+  int predicted;	// Direction fetch predicted for BZ/BNZ
+  int prediction_slot;
+  int next_pc;		// Architectural pc after the instruction
+} OOO_Rob_Entry;
+
+/* Reservation station, holding an instruction until it completes */
+typedef struct OOO_Rs_Entry
+{
+  int busy;
+  int issued;
+  int src[2];		// Physical sources, -1 for none
+  int result;		// Value produced when issued
+  int complete_at;	// Clock at which the result is written
+} OOO_Rs_Entry;
+
+/* Load/store queue entry, in program order */
+typedef struct OOO_Lsq_Entry
+{
+  int store;
+  int address_known;
+  int address;
+  int value;		// Data of a store
+} OOO_Lsq_Entry;
+
+typedef struct APEX_Ooo
+{
+  int phys[OOO_PHYS_REGS];
+  unsigned char ready[OOO_PHYS_REGS];
+  int map[OOO_ARCH_REGS];	// Rename table
+  int free_list[OOO_PHYS_REGS];
+  int num_free;
+
+  OOO_Rob_Entry rob[OOO_ROB_SIZE];
+  int rob_head;
+  int rob_count;
+  OOO_Rs_Entry rs[OOO_RS_SIZE];
+  OOO_Lsq_Entry lsq[OOO_LSQ_SIZE];
+  int lsq_head;
+  int lsq_count;
+
+  /* Front end: the instruction waiting for rename and where fetch goes */
+  int fetch_pc;
+  int fetched;		// An instruction waits for rename
+  CPU_Stage fetch_latch;
+  int fetch_stopped;	// HALT fetched
+  int halted;		// HALT committed
+} APEX_Ooo;
+
+/* State of the core, created on the first cycle it simulates. With nothing
+ * in flight the core takes up the committed state of the cpu, which a
+ * fast-forward may have moved on since.
+ */
+static APEX_Ooo*
+ooo_state(APEX_CPU* cpu)
+{
+  APEX_Ooo* ooo = cpu->ooo;
+  if (!ooo) {
+    ooo = calloc(1, sizeof(*ooo));
+    if (!ooo) {
+      return NULL;
+    }
+    for (int i = 0; i < OOO_ARCH_REGS; ++i) {
+      ooo->map[i] = i;
+      ooo->ready[i] = 1;
+    }
+    for (int i = OOO_PHYS_REGS - 1; i >= OOO_ARCH_REGS; --i) {
+      ooo->free_list[ooo->num_free++] = i;
+    }
+    cpu->ooo = ooo;
+  }
+
+  if (ooo->rob_count == 0 && !ooo->fetched && !ooo->halted) {
+    for (int i = 0; i < APEX_NUM_REGS; ++i) {
+      ooo->phys[ooo->map[i]] = cpu->regs[i];
+    }
+    ooo->phys[ooo->map[OOO_ZF]] = !cpu->zero_flag;
+    ooo->fetch_pc = cpu->pc;
+  }
+  return ooo;
+}
+
+static inline OOO_Rob_Entry*
+rob_entry(APEX_Ooo* ooo, int age)
+{
+  return &ooo->rob[(ooo->rob_head + age) % OOO_ROB_SIZE];
+}
+
+/* Prints an instruction in flight under the name of the step it is in */
+static void
+show(APEX_CPU* cpu, const char* name, const OOO_Rob_Entry* entry)
+{
+  if (cpu->verbosity >= APEX_VERBOSITY_STAGE) {
+    CPU_Stage stage = { .pc = entry->pc,
+                        .index = entry->index,
+                        .opcode = entry->opcode };
+    APEX_print_latch(cpu, name, &stage);
+  }
+}
+
+/* Retires the oldest instruction once it is done */
+static void
+ooo_commit(APEX_CPU* cpu, APEX_Ooo* ooo)
+{
+  if (ooo->rob_count == 0 || !rob_entry(ooo, 0)->done) {
+    return;
+  }
+
+  OOO_Rob_Entry* entry = rob_entry(ooo, 0);
+  show(cpu, "Commit", entry);
+  if (entry->rd >= 0) {
+    cpu->regs[entry->rd] = ooo->phys[entry->phys];
+    ooo->free_list[ooo->num_free++] = entry->old_phys;
+  }
+  if (entry->flag_phys >= 0) {
+    cpu->zero_flag = ooo->phys[entry->flag_phys] == 0;
+    ooo->free_list[ooo->num_free++] = entry->old_flag_phys;
+  }
+  if (entry->lsq >= 0) {
+    OOO_Lsq_Entry* access = &ooo->lsq[ooo->lsq_head];
+    if (access->store) {
+      APEX_mem_store(cpu, access->address, access->value);
+    }
+    ooo->lsq_head = (ooo->lsq_head + 1) % OOO_LSQ_SIZE;
+    ooo->lsq_count--;
+  }
+  if (entry->opcode == OPCODE_HALT) {
+    ooo->halted = 1;
+  }
+
+  cpu->pc = entry->next_pc;
+  cpu->counters.committed++;
+  ooo->rob_head = (ooo->rob_head + 1) % OOO_ROB_SIZE;
+  ooo->rob_count--;
+}
+
+/* Discards every instruction younger than the one at age, undoing their
+ * renames youngest first, and restarts fetch at pc
+ */
+static void
+ooo_flush(APEX_CPU* cpu, APEX_Ooo* ooo, int age, int pc)
+{
+  while (ooo->rob_count > age + 1) {
+    OOO_Rob_Entry* entry = rob_entry(ooo, ooo->rob_count - 1);
+    if (entry->rd >= 0) {
+      ooo->map[entry->rd] = entry->old_phys;
+      ooo->free_list[ooo->num_free++] = entry->phys;
+    }
+    if (entry->flag_phys >= 0) {
+      ooo->map[OOO_ZF] = entry->old_flag_phys;
+      ooo->free_list[ooo->num_free++] = entry->flag_phys;
+    }
+    if (entry->rs >= 0) {
+      ooo->rs[entry->rs].busy = 0;
+    }
+    if (entry->lsq >= 0) {
+      ooo->lsq_count--;
+    }
+    ooo->rob_count--;
+    cpu->counters.flushed++;
+    cpu->counters.penalty++;
+  }
+
+  if (ooo->fetched) {
+    ooo->fetched = 0;
+    cpu->counters.penalty++;
+  }
+  ooo->fetch_pc = pc;
+  ooo->fetch_stopped = 0;
+}
+
+/* Writes back the results whose latency has elapsed, oldest first, and
+ * resolves branches. A mispredicted branch flushes everything behind it.
+ */
+static void
+ooo_complete(APEX_CPU* cpu, APEX_Ooo* ooo)
+{
+  for (int age = 0; age < ooo->rob_count; ++age) {
+    OOO_Rob_Entry* entry = rob_entry(ooo, age);
+    if (entry->rs < 0 || !ooo->rs[entry->rs].issued ||
+        ooo->rs[entry->rs].complete_at > cpu->clock) {
+      continue;
+    }
+
+    OOO_Rs_Entry* station = &ooo->rs[entry->rs];
+    station->busy = 0;
+    entry->rs = -1;
+    entry->done = 1;
+    if (entry->rd >= 0) {
+      ooo->phys[entry->phys] = station->result;
+      ooo->ready[entry->phys] = 1;
+    }
+    if (entry->flag_phys >= 0) {
+      ooo->phys[entry->flag_phys] = station->result;
+      ooo->ready[entry->flag_phys] = 1;
+    }
+
+    if (opcode_info[entry->opcode].flags & OPF_BRANCH) {
+      int taken = station->result;
+      int target = APEX_branch_target(
+        entry->pc, APEX_imm(cpu->code_memory[entry->index]));
+      CPU_Stage branch = { .pc = entry->pc,
+                           .prediction_slot = entry->prediction_slot };
+
+      cpu->counters.branches[taken]++;
+      APEX_predictor_update(cpu, &branch, taken, target);
+      entry->next_pc = taken ? target : entry->pc + 4;
+      if (taken != entry->predicted) {
+        cpu->counters.mispredicts++;
+        ooo_flush(cpu, ooo, age, entry->next_pc);
+      }
+    }
+  }
+}
+
+static inline int
+operand(APEX_Ooo* ooo, const OOO_Rs_Entry* station, int i)
+{
+  return station->src[i] >= 0 ? ooo->phys[station->src[i]] : 0;
+}
+
+static inline int
+operands_ready(APEX_Ooo* ooo, const OOO_Rs_Entry* station)
+{
+  return (station->src[0] < 0 || ooo->ready[station->src[0]]) &&
+         (station->src[1] < 0 || ooo->ready[station->src[1]]);
+}
+
+/* A load issues once every older store knows its address. The youngest
+ * older store to the same address supplies the value, data memory
+ * otherwise. Returns 0 while the load has to wait.
+ */
+static int
+load_value(APEX_CPU* cpu, APEX_Ooo* ooo, int lsq, int address, int* value)
+{
+  int forwarded = 0;
+  for (int i = ooo->lsq_head; i != lsq; i = (i + 1) % OOO_LSQ_SIZE) {
+    const OOO_Lsq_Entry* older = &ooo->lsq[i];
+    if (!older->store) {
+      continue;
+    }
+    if (!older->address_known) {
+      return 0;
+    }
+    if (older->address == address) {
+      *value = older->value;
+      forwarded = 1;
+    }
+  }
+  if (forwarded) {
+    cpu->counters.store_forwarded++;
+  } else {
+    *value = APEX_mem_load(cpu, address);
+  }
+  return 1;
+}
+
+/* Executes the instruction of a reservation station whose operands are
+ * ready, returns 0 if it has to wait
+ */
+static int
+ooo_execute(APEX_CPU* cpu, APEX_Ooo* ooo, OOO_Rob_Entry* entry,
+        OOO_Rs_Entry* station)
+{
+  APEX_Instruction ins = cpu->code_memory[entry->index];
+  int a = operand(ooo, station, 0);
+  int b = (opcode_info[entry->opcode].flags & OPF_RS2) ? operand(ooo, station, 1)
+                                                       : APEX_imm(ins);
+  int unit = APEX_unit(entry->opcode);
+  int latency = cpu->units[unit].latency;
+
+  switch (entry->opcode) {
+  case OPCODE_MOVC:
+    station->result = APEX_imm(ins);
+    break;
+  case OPCODE_ADD:
+  case OPCODE_ADDL:
+    station->result = a + b;
+    break;
+  case OPCODE_SUB:
+  case OPCODE_SUBL:
+    station->result = a - b;
+    break;
+  case OPCODE_MUL:
+    station->result = a * b;
+    break;
+  case OPCODE_AND:
+    station->result = a & b;
+    break;
+  case OPCODE_OR:
+    station->result = a | b;
+    break;
+  case OPCODE_EXOR:
+    station->result = a ^ b;
+    break;
+  case OPCODE_BZ:
+    station->result = (a == 0);
+    break;
+  case OPCODE_BNZ:
+    station->result = (a != 0);
+    break;
+  case OPCODE_LOAD: {
+    OOO_Lsq_Entry* access = &ooo->lsq[entry->lsq];
+    access->address = a + APEX_imm(ins);
+    if (!load_value(cpu, ooo, entry->lsq, access->address,
+                    &station->result)) {
+      return 0;
+    }
+    access->address_known = 1;
+    latency += OOO_LOAD_MEMORY_LATENCY;
+    break;
+  }
+  case OPCODE_STORE: {
+    OOO_Lsq_Entry* access = &ooo->lsq[entry->lsq];
+    access->address = operand(ooo, station, 1) + APEX_imm(ins);
+    access->value = a;
+    access->address_known = 1;
+    break;
+  }
+  }
+
+  station->issued = 1;
+  station->complete_at = cpu->clock + latency;
+  cpu->unit_free[unit] = cpu->clock + cpu->units[unit].interval;
+  return 1;
+}
+
+/* Issues the oldest ready instruction to the ALU and the oldest ready
+ * load or store to the memory port. MUL and BZ/BNZ issue through the ALU
+ * port to their own units, which must be free.
+ */
+static void
+ooo_issue(APEX_CPU* cpu, APEX_Ooo* ooo)
+{
+  int alu_free = 1;
+  int mem_free = 1;
+
+  for (int age = 0; age < ooo->rob_count && (alu_free || mem_free); ++age) {
+    OOO_Rob_Entry* entry = rob_entry(ooo, age);
+    if (entry->rs < 0) {
+      continue;
+    }
+    OOO_Rs_Entry* station = &ooo->rs[entry->rs];
+    int* port = (opcode_info[entry->opcode].flags & OPF_MEM) ? &mem_free
+                                                             : &alu_free;
+    if (station->issued || !*port || !operands_ready(ooo, station) ||
+        cpu->clock < cpu->unit_free[APEX_unit(entry->opcode)]) {
+      continue;
+    }
+    if (ooo_execute(cpu, ooo, entry, station)) {
+      show(cpu, "Issue", entry);
+      *port = 0;
+    }
+  }
+}
+
+static inline int
+allocate_phys(APEX_Ooo* ooo)
+{
+  int phys = ooo->free_list[--ooo->num_free];
+  ooo->ready[phys] = 0;
+  return phys;
+}
+
+/* Renames the fetched instruction and places it into the reorder buffer,
+ * a reservation station and the load/store queue, stalling while one of
+ * them is full
+ */
+static void
+ooo_rename(APEX_CPU* cpu, APEX_Ooo* ooo)
+{
+  if (!ooo->fetched) {
+    return;
+  }
+
+  CPU_Stage* fetched = &ooo->fetch_latch;
+  APEX_Instruction ins = cpu->code_memory[fetched->index];
+  int flags = opcode_info[fetched->opcode].flags;
+  int needs_rs =
+    fetched->opcode != OPCODE_NOP && fetched->opcode != OPCODE_HALT &&
+    fetched->opcode != OPCODE_NONE;
+  int rs = -1;
+
+  if (ooo->rob_count == OOO_ROB_SIZE) {
+    cpu->counters.stalls[APEX_STALL_ROB]++;
+    return;
+  }
+  if (needs_rs) {
+    for (rs = 0; rs < OOO_RS_SIZE && ooo->rs[rs].busy; ++rs) {
+    }
+    if (rs == OOO_RS_SIZE) {
+      cpu->counters.stalls[APEX_STALL_RS]++;
+      return;
+    }
+  }
+  if ((flags & OPF_MEM) && ooo->lsq_count == OOO_LSQ_SIZE) {
+    cpu->counters.stalls[APEX_STALL_LSQ]++;
+    return;
+  }
+
+  OOO_Rob_Entry* entry = rob_entry(ooo, ooo->rob_count++);
+  memset(entry, 0, sizeof(*entry));
+  entry->pc = fetched->pc;
+  entry->index = fetched->index;
+  entry->opcode = fetched->opcode;
+  entry->predicted = fetched->predicted;
+  entry->prediction_slot = fetched->prediction_slot;
+  entry->next_pc = fetched->pc + 4;
+  entry->rd = -1;
+  entry->flag_phys = -1;
+  entry->rs = rs;
+  entry->lsq = -1;
+  entry->done = !needs_rs;
+  if (fetched->opcode == OPCODE_HALT) {
+    entry->next_pc = fetched->pc;
+  }
+
+  if (needs_rs) {
+    OOO_Rs_Entry* station = &ooo->rs[rs];
+    memset(station, 0, sizeof(*station));
+    station->busy = 1;
+    station->src[0] = (flags & OPF_RS1)      ? ooo->map[APEX_rs1(ins)]
+                      : (flags & OPF_BRANCH) ? ooo->map[OOO_ZF]
+                                             : -1;
+    station->src[1] = (flags & OPF_RS2) ? ooo->map[APEX_rs2(ins)] : -1;
+  }
+  if (flags & OPF_MEM) {
+    entry->lsq = (ooo->lsq_head + ooo->lsq_count++) % OOO_LSQ_SIZE;
+    memset(&ooo->lsq[entry->lsq], 0, sizeof(OOO_Lsq_Entry));
+    ooo->lsq[entry->lsq].store = !(flags & OPF_RD);
+  }
+  if (flags & OPF_RD) {
+    entry->rd = APEX_rd(ins);
+    entry->old_phys = ooo->map[entry->rd];
+    entry->phys = allocate_phys(ooo);
+    ooo->map[entry->rd] = entry->phys;
+  }
+  if (flags & OPF_SETS_ZF) {
+    entry->old_flag_phys = ooo->map[OOO_ZF];
+    entry->flag_phys = allocate_phys(ooo);
+    ooo->map[OOO_ZF] = entry->flag_phys;
+  }
+
+  show(cpu, "Rename", entry);
+  ooo->fetched = 0;
+}
+
+/* Fetches the next instruction down the predicted path. Fetch stops at a
+ * HALT until a mispredicted branch restarts it.
+ */
+static void
+ooo_fetch(APEX_CPU* cpu, APEX_Ooo* ooo)
+{
+  int index = get_code_index(ooo->fetch_pc);
+  if (ooo->fetched || ooo->fetch_stopped || index < 0 ||
+      index >= cpu->code_memory_size) {
+    return;
+  }
+
+  CPU_Stage* stage = &ooo->fetch_latch;
+  memset(stage, 0, sizeof(*stage));
+  stage->pc = ooo->fetch_pc;
+  stage->index = index;
+  stage->opcode = APEX_opcode(cpu->code_memory[index]);
+  if (cpu->verbosity >= APEX_VERBOSITY_STAGE) {
+    APEX_print_latch(cpu, "Fetch", stage);
+  }
+
+  if (opcode_info[stage->opcode].flags & OPF_BRANCH) {
+    ooo->fetch_pc = APEX_predict(cpu, stage);
+  } else {
+    ooo->fetch_pc += 4;
+  }
+  if (stage->opcode == OPCODE_HALT) {
+    ooo->fetch_stopped = 1;
+  }
+  ooo->fetched = 1;
+}
+
+/*
+ * Simulates one clock cycle of the out-of-order core
+ */
+int
+APEX_ooo_step(APEX_CPU* cpu)
+{
+  APEX_Ooo* ooo = ooo_state(cpu);
+  if (!ooo) {
+    return -1;
+  }
+
+  if (!ooo->halted) {
+    if (ooo->fetch_stopped && ooo->rob_count > 0) {
+      cpu->counters.stalls[APEX_STALL_HALT]++;
+    }
+    ooo_commit(cpu, ooo);
+    ooo_complete(cpu, ooo);
+    ooo_issue(cpu, ooo);
+    ooo_rename(cpu, ooo);
+    ooo_fetch(cpu, ooo);
+  }
+  cpu->clock++;
+  return 0;
+}
+
+/*
+ * True when nothing is in flight in the out-of-order core
+ */
+int
+APEX_ooo_empty(const APEX_CPU* cpu)
+{
+  const APEX_Ooo* ooo = cpu->ooo;
+  return !ooo || (ooo->rob_count == 0 && !ooo->fetched);
+}
+
+/*
+ * True when further cycles of the out-of-order core change nothing but the
+ * clock: HALT has committed, or fetch has left code memory with nothing in
+ * flight
+ */
+int
+APEX_ooo_idle(const APEX_CPU* cpu)
+{
+  const APEX_Ooo* ooo = cpu->ooo;
+  if (!ooo) {
+    return 0;
+  }
+
+  int index = get_code_index(ooo->fetch_pc);
+  return ooo->halted ||
+         (APEX_ooo_empty(cpu) &&
+          (ooo->fetch_stopped || index < 0 ||
+           index >= cpu->code_memory_size));
+}
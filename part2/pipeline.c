@@ -0,0 +1,109 @@
+/*
+ *  pipeline.c
+ *  Builds the stage table of the in-order pipeline from a layout naming its
+ *  stages from fetch to writeback. The 7-stage pipeline is the original
+ *  one; the 5-stage one runs EX1 and EX2, and MEM1 and MEM2, each within a
+ *  single cycle, and the 9-stage one fetches over three cycles.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* Stages a pipeline is built from, each working on the latches from in up
+ * to last. The latch a stage hands its group to is the first one of the
+ * stage after it in the layout.
+ */
+static const APEX_Stage_Desc stage_kinds[] = {
+  { "Fetch", "F", fetch, F, F, 0 },
+  { "Fetch2", "F2", fetch2, F2, F2, 0 },
+  { "Fetch3", "F3", fetch3, F3, F3, 0 },
+  { "Decode/RF", "DRF", decode, DRF, DRF, 0 },
+  { "Execute", "EX", execute, EX1, EX2, 0 },
+  { "Execute1", "EX1", execute1, EX1, EX1, 0 },
+  { "Execute2", "EX2", execute2, EX2, EX2, 0 },
+  { "Memory", "MEM", memory, MEM1, MEM2, 0 },
+  { "Memory1", "MEM1", memory1, MEM1, MEM1, 0 },
+  { "Memory2", "MEM2", memory2, MEM2, MEM2, 0 },
+  { "Writeback", "WB", writeback, WB, WB, 0 },
+};
+
+/* Layouts of the pipelines a cpu can have, by stage key, NULL terminated */
+static const char* const layouts[][NUM_STAGES + 1] = {
+  { "F", "DRF", "EX", "MEM", "WB", NULL },
+  { "F", "DRF", "EX1", "EX2", "MEM1", "MEM2", "WB", NULL },
+  { "F", "F2", "F3", "DRF", "EX1", "EX2", "MEM1", "MEM2", "WB", NULL },
+};
+
+static const APEX_Stage_Desc*
+find_stage_kind(const char* key)
+{
+  for (size_t i = 0; i < sizeof(stage_kinds) / sizeof(stage_kinds[0]); ++i) {
+    if (strcmp(stage_kinds[i].key, key) == 0) {
+      return &stage_kinds[i];
+    }
+  }
+  return NULL;
+}
+
+/* Fills pipeline with the stages of layout, -1 on an unknown stage key */
+static int
+build_pipeline(APEX_Pipeline* pipeline, const char* const* layout)
+{
+  int depth = 0;
+  for (; layout[depth]; ++depth) {
+    const APEX_Stage_Desc* kind = find_stage_kind(layout[depth]);
+    if (!kind) {
+      return -1;
+    }
+    pipeline->stages[depth] = *kind;
+    if (depth > 0) {
+      pipeline->stages[depth - 1].out = kind->in;
+    }
+  }
+  pipeline->stages[depth - 1].out = NUM_STAGES;
+  pipeline->depth = depth;
+  return 0;
+}
+
+/*
+ * Builds the pipeline of depth stages for the cpu, linking each latch it
+ * uses to the one after it. Returns 0 on success, -1 if there is no such
+ * pipeline. The pipeline must be set before the first cycle.
+ */
+int
+APEX_cpu_set_pipeline(APEX_CPU* cpu, int depth)
+{
+  const char* const* layout = NULL;
+  for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+    int stages = 0;
+    while (layouts[i][stages]) {
+      stages++;
+    }
+    if (stages == depth) {
+      layout = layouts[i];
+    }
+  }
+
+  APEX_Pipeline pipeline;
+  if (!layout || build_pipeline(&pipeline, layout) != 0) {
+    fprintf(stderr, "APEX_Pipeline : No %d-stage pipeline, use 5, 7 or 9\n",
+            depth);
+    return -1;
+  }
+
+  for (int i = 0; i < NUM_STAGES; ++i) {
+    cpu->next[i] = NUM_STAGES;
+    cpu->stage_name[i] = NULL;
+  }
+  for (int i = 0; i < pipeline.depth; ++i) {
+    const APEX_Stage_Desc* stage = &pipeline.stages[i];
+    for (int id = stage->in; id < stage->last; ++id) {
+      cpu->next[id] = id + 1;
+    }
+    cpu->next[stage->last] = stage->out;
+    cpu->stage_name[stage->in] = stage->name;
+  }
+  cpu->pipeline = pipeline;
+  return 0;
+}
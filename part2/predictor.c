@@ -0,0 +1,143 @@
+/*
+ *  predictor.c
+ *  Branch prediction unit of the APEX pipeline: a branch target buffer and
+ *  the direction predictors fetch can be configured with
+ */
+#include <string.h>
+
+#include "cpu.h"
+
+#define PHT_MASK ((1 << APEX_PHT_BITS) - 1)
+
+/* A direction predictor: slot picks the pattern table entry for the branch
+ * at pc, predict reads the direction from it. Predictors without a table
+ * use slot 0.
+ */
+typedef struct APEX_Predictor_Ops
+{
+  const char* name;
+  int (*slot)(const APEX_Predictor* predictor, int pc);
+  int (*predict)(const APEX_Predictor* predictor, int slot, int pc,
+                 int target);
+} APEX_Predictor_Ops;
+
+static int
+no_slot(const APEX_Predictor* predictor, int pc)
+{
+  (void)predictor;
+  (void)pc;
+  return 0;
+}
+
+static int
+bimodal_slot(const APEX_Predictor* predictor, int pc)
+{
+  (void)predictor;
+  return (pc >> 2) & PHT_MASK;
+}
+
+static int
+gshare_slot(const APEX_Predictor* predictor, int pc)
+{
+  return ((pc >> 2) ^ predictor->history) & PHT_MASK;
+}
+
+static int
+predict_not_taken(const APEX_Predictor* predictor, int slot, int pc,
+                  int target)
+{
+  (void)predictor;
+  (void)slot;
+  (void)pc;
+  (void)target;
+  return 0;
+}
+
+/* Loops branch backwards */
+static int
+predict_backward_taken(const APEX_Predictor* predictor, int slot, int pc,
+                       int target)
+{
+  (void)predictor;
+  (void)slot;
+  return target <= pc;
+}
+
+static int
+predict_counter(const APEX_Predictor* predictor, int slot, int pc,
+                int target)
+{
+  (void)pc;
+  (void)target;
+  return predictor->pht[slot] >= 2;
+}
+
+static const APEX_Predictor_Ops predictor_ops[APEX_NUM_PREDICTORS] = {
+  [APEX_PREDICT_NONE] = { "none", no_slot, predict_not_taken },
+  [APEX_PREDICT_STATIC] = { "static", no_slot, predict_backward_taken },
+  [APEX_PREDICT_BIMODAL] = { "bimodal", bimodal_slot, predict_counter },
+  [APEX_PREDICT_GSHARE] = { "gshare", gshare_slot, predict_counter },
+};
+
+/*
+ * Maps a predictor name onto its APEX_PREDICT_* kind, -1 if unknown
+ */
+int
+APEX_predictor_kind(const char* name)
+{
+  for (int i = 0; i < APEX_NUM_PREDICTORS; ++i) {
+    if (strcmp(name, predictor_ops[i].name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static inline int
+btb_entry(int pc)
+{
+  return (pc >> 2) & (APEX_BTB_SIZE - 1);
+}
+
+/*
+ * Predicts the branch fetch has just placed in stage, recording the
+ * prediction in the latch, and returns the pc to fetch from next
+ */
+int
+APEX_predict(APEX_CPU* cpu, CPU_Stage* stage)
+{
+  const APEX_Predictor* predictor = &cpu->predictor;
+  const APEX_Predictor_Ops* ops = &predictor_ops[predictor->kind];
+  int entry = btb_entry(stage->pc);
+
+  stage->prediction_slot = ops->slot(predictor, stage->pc);
+  stage->predicted = predictor->btb_pc[entry] == stage->pc &&
+                     ops->predict(predictor, stage->prediction_slot,
+                                  stage->pc, predictor->btb_target[entry]);
+  return stage->predicted ? predictor->btb_target[entry] : stage->pc + 4;
+}
+
+/*
+ * Trains the predictor with the outcome of the branch resolved in stage.
+ * Taken branches enter the BTB.
+ */
+void
+APEX_predictor_update(APEX_CPU* cpu, const CPU_Stage* stage, int taken,
+                      int target)
+{
+  APEX_Predictor* predictor = &cpu->predictor;
+  unsigned char* counter = &predictor->pht[stage->prediction_slot];
+
+  if (taken && *counter < 3) {
+    (*counter)++;
+  } else if (!taken && *counter > 0) {
+    (*counter)--;
+  }
+  predictor->history = ((predictor->history << 1) | taken) & PHT_MASK;
+
+  if (taken) {
+    int entry = btb_entry(stage->pc);
+    predictor->btb_pc[entry] = stage->pc;
+    predictor->btb_target[entry] = target;
+  }
+}
@@ -0,0 +1,435 @@
+/*
+ *  snapshot.c
+ *  Contains functions to save the complete state of an APEX cpu to a
+ *  snapshot file and to resume a cpu from one
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* Direction of a transfer between a cpu and a snapshot file */
+typedef struct APEX_Snapshot_IO
+{
+  FILE* fp;
+  int saving;	// 1 to write the cpu out, 0 to read it back
+  int failed;
+  const char* mismatch;	// Why the snapshot does not fit the cpu, if so
+} APEX_Snapshot_IO;
+
+static void
+transfer_ints(APEX_Snapshot_IO* io, int* values, int count)
+{
+  for (int i = 0; i < count && !io->failed; ++i) {
+    int32_t value = values[i];
+    if (io->saving) {
+      io->failed = fwrite(&value, sizeof(value), 1, io->fp) != 1;
+    } else {
+      io->failed = fread(&value, sizeof(value), 1, io->fp) != 1;
+      values[i] = value;
+    }
+  }
+}
+
+static void
+transfer_long(APEX_Snapshot_IO* io, long* value)
+{
+  int64_t wide = *value;
+  if (io->saving) {
+    io->failed = io->failed || fwrite(&wide, sizeof(wide), 1, io->fp) != 1;
+  } else {
+    io->failed = io->failed || fread(&wide, sizeof(wide), 1, io->fp) != 1;
+    *value = wide;
+  }
+}
+
+static void
+transfer_longs(APEX_Snapshot_IO* io, long* values, int count)
+{
+  for (int i = 0; i < count; ++i) {
+    transfer_long(io, &values[i]);
+  }
+}
+
+/* Fails a restore on a value no cpu could have been saved with */
+static void
+mark_corrupt(APEX_Snapshot_IO* io)
+{
+  io->failed = 1;
+  io->mismatch = "is corrupt";
+}
+
+/* A restored latch must name an opcode, an instruction of code memory and
+ * a pattern table slot, or the next cycle reads outside of their tables
+ */
+static void
+transfer_latch(APEX_Snapshot_IO* io, CPU_Stage* stage, int code_size)
+{
+  int fields[12] = { stage->pc,          stage->index,
+                     stage->opcode,      stage->busy,
+                     stage->stalled,     stage->squashed,
+                     stage->predicted,   stage->prediction_slot,
+                     stage->rs1_value,   stage->rs2_value,
+                     stage->buffer,      stage->mem_address };
+
+  transfer_ints(io, fields, 12);
+  if (!io->saving && !io->failed) {
+    if (fields[1] < 0 || fields[1] >= code_size || fields[2] < 0 ||
+        fields[2] >= NUM_OPCODES || fields[7] < 0 ||
+        fields[7] >= (1 << APEX_PHT_BITS)) {
+      mark_corrupt(io);
+      return;
+    }
+    stage->pc = fields[0];
+    stage->index = fields[1];
+    stage->opcode = fields[2];
+    stage->busy = fields[3];
+    stage->stalled = fields[4];
+    stage->squashed = fields[5];
+    stage->predicted = fields[6];
+    stage->prediction_slot = fields[7];
+    stage->rs1_value = fields[8];
+    stage->rs2_value = fields[9];
+    stage->buffer = fields[10];
+    stage->mem_address = fields[11];
+  }
+}
+
+/* The predictor's configuration stays with the cpu, its learned state
+ * travels with the snapshot
+ */
+static void
+transfer_predictor(APEX_Snapshot_IO* io, APEX_Predictor* predictor)
+{
+  int pht[1 << APEX_PHT_BITS];
+  for (int i = 0; i < (1 << APEX_PHT_BITS); ++i) {
+    pht[i] = predictor->pht[i];
+  }
+
+  transfer_ints(io, &predictor->history, 1);
+  transfer_ints(io, pht, 1 << APEX_PHT_BITS);
+  transfer_ints(io, predictor->btb_pc, APEX_BTB_SIZE);
+  transfer_ints(io, predictor->btb_target, APEX_BTB_SIZE);
+  if (!io->saving) {
+    for (int i = 0; i < (1 << APEX_PHT_BITS); ++i) {
+      predictor->pht[i] = pht[i];
+    }
+  }
+}
+
+/* Like the predictor, a cache keeps its configuration and the snapshot
+ * carries the lines it holds. A snapshot only fits a cpu with a cache of as
+ * many lines, or with none if it was taken without one.
+ */
+static void
+transfer_cache(APEX_Snapshot_IO* io, APEX_Cache* cache, const char* mismatch)
+{
+  int lines = cache ? cache->sets * cache->config.ways : 0;
+  int saved = lines;
+
+  transfer_ints(io, &saved, 1);
+  if (!io->failed && saved != lines) {
+    io->failed = 1;
+    io->mismatch = mismatch;
+  }
+  if (!cache || io->failed) {
+    return;
+  }
+
+  transfer_ints(io, &cache->accesses, 1);
+  transfer_ints(io, &cache->seed, 1);
+  transfer_ints(io, cache->plru, cache->sets);
+  for (int i = 0; i < lines; ++i) {
+    APEX_Cache_Line* line = &cache->lines[i];
+    int fields[4] = { line->tag, line->valid, line->dirty, line->stamp };
+    transfer_ints(io, fields, 4);
+    line->tag = fields[0];
+    line->valid = fields[1];
+    line->dirty = fields[2];
+    line->stamp = fields[3];
+  }
+}
+
+/* Data memory travels as its allocated pages in ascending order, each
+ * behind its number. The size of data memory belongs to the cpu, which must
+ * hold every page of the snapshot.
+ */
+static void
+transfer_memory(APEX_Snapshot_IO* io, APEX_Memory* memory)
+{
+  int pages = memory->pages;
+  uint32_t number = 0;
+
+  transfer_ints(io, &pages, 1);
+  for (int i = 0; i < pages && !io->failed; ++i) {
+    if (io->saving) {
+      number = APEX_memory_next_page(memory, i == 0 ? 0 : number + 1);
+    }
+    int saved = number;
+    transfer_ints(io, &saved, 1);
+    number = saved;
+    if (io->failed) {
+      return;
+    }
+    if ((uint64_t)number << APEX_PAGE_BITS >= memory->size) {
+      io->failed = 1;
+      io->mismatch = "was taken with a larger data memory";
+      return;
+    }
+
+    int* page = APEX_memory_page(memory, number, !io->saving);
+    if (!page) {
+      io->failed = 1;
+      io->mismatch = "does not fit in memory";
+      return;
+    }
+    transfer_ints(io, page, APEX_PAGE_SIZE);
+  }
+}
+
+/* The queue's size stays with the cpu, which must have room for the stores
+ * the snapshot holds
+ */
+static void
+transfer_store_queue(APEX_Snapshot_IO* io, APEX_Store_Queue* queue)
+{
+  int fields[6] = { queue->head,    queue->count,
+                    queue->wait,    queue->pending,
+                    queue->pending_address, queue->port_taken };
+
+  transfer_ints(io, fields, 6);
+  if (!io->saving && !io->failed) {
+    if (fields[0] < 0 || fields[0] >= APEX_STORE_QUEUE_MAX || fields[1] < 0) {
+      mark_corrupt(io);
+      return;
+    }
+    if (fields[1] > queue->size) {
+      io->failed = 1;
+      io->mismatch = "was taken with a larger store queue";
+      return;
+    }
+    queue->head = fields[0];
+    queue->count = fields[1];
+    queue->wait = fields[2];
+    queue->pending = fields[3];
+    queue->pending_address = fields[4];
+    queue->port_taken = fields[5];
+  }
+  transfer_ints(io, queue->address, APEX_STORE_QUEUE_MAX);
+}
+
+static void
+transfer_counters(APEX_Snapshot_IO* io, APEX_Counters* counters)
+{
+  transfer_long(io, &counters->committed);
+  transfer_longs(io, counters->stalls, APEX_NUM_STALLS);
+  transfer_long(io, &counters->forwarded);
+  transfer_longs(io, counters->bubbles, NUM_STAGES);
+  transfer_longs(io, counters->branches, 2);
+  transfer_long(io, &counters->flushed);
+  transfer_long(io, &counters->mispredicts);
+  transfer_long(io, &counters->penalty);
+  transfer_long(io, &counters->idle);
+  transfer_longs(io, counters->dcache, APEX_NUM_CACHE_EVENTS);
+  transfer_long(io, &counters->store_forwarded);
+  transfer_longs(io, counters->icache, APEX_NUM_CACHE_EVENTS);
+}
+
+/* The pipeline stays with the cpu, which must have as many stages as the
+ * one the snapshot was taken from
+ */
+static void
+transfer_depth(APEX_Snapshot_IO* io, const APEX_Pipeline* pipeline)
+{
+  int depth = pipeline->depth;
+
+  transfer_ints(io, &depth, 1);
+  if (!io->failed && depth != pipeline->depth) {
+    io->failed = 1;
+    io->mismatch = "was taken with a different pipeline depth";
+  }
+}
+
+/*
+ * Moves the state of the cpu in snapshot order. Latch groups are stored in
+ * latch order, whichever storage the stage pointers currently refer to, with
+ * all APEX_MAX_WIDTH slots whatever the width and every latch whatever the
+ * depth.
+ */
+static void
+transfer_cpu(APEX_Snapshot_IO* io, APEX_CPU* cpu)
+{
+  transfer_ints(io, &cpu->clock, 1);
+  transfer_ints(io, &cpu->pc, 1);
+  transfer_ints(io, &cpu->zero_flag, 1);
+  if (!io->saving && !io->failed && (cpu->zero_flag & ~1)) {
+    mark_corrupt(io);
+  }
+  transfer_ints(io, &cpu->branch_wait, 1);
+  transfer_ints(io, &cpu->branch_target, 1);
+  transfer_predictor(io, &cpu->predictor);
+  transfer_ints(io, cpu->unit_free, APEX_NUM_UNITS);
+  transfer_ints(io, cpu->reg_ready, APEX_NUM_REGS);
+  transfer_ints(io, &cpu->zero_flag_ready, 1);
+  transfer_ints(io, &cpu->ex_wait, 1);
+  transfer_ints(io, cpu->regs, APEX_NUM_REGS);
+  transfer_ints(io, cpu->regs_valid, APEX_NUM_REGS);
+  transfer_depth(io, &cpu->pipeline);
+  for (int i = F; i < NUM_STAGES; ++i) {
+    for (int k = 0; k < APEX_MAX_WIDTH; ++k) {
+      transfer_latch(io, &cpu->stage[i][k], cpu->code_memory_size);
+    }
+  }
+  transfer_memory(io, &cpu->memory);
+  transfer_ints(io, &cpu->mem_wait, 1);
+  transfer_cache(io, cpu->dcache, "was taken with a different data cache");
+  transfer_store_queue(io, &cpu->store_queue);
+  transfer_ints(io, &cpu->buffer_pc, 1);
+  transfer_ints(io, &cpu->buffer_count, 1);
+  transfer_ints(io, &cpu->fetch_wait, 1);
+  transfer_cache(io, cpu->icache,
+                 "was taken with a different instruction cache");
+  transfer_counters(io, &cpu->counters);
+  transfer_long(io, &cpu->fast_forwarded);
+}
+
+/*
+ * FNV-1a hash of code memory, which ties snapshots and traces to the
+ * program they were taken from
+ */
+uint32_t
+APEX_cpu_code_checksum(const APEX_CPU* cpu)
+{
+  const unsigned char* bytes = (const unsigned char*)cpu->code_memory;
+  size_t length = sizeof(*cpu->code_memory) * cpu->code_memory_size;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * Writes the state of the cpu to a snapshot file, returns 0 on success.
+ * The out-of-order core can only be saved with nothing in flight.
+ */
+int
+APEX_cpu_save(const APEX_CPU* cpu, const char* filename)
+{
+  if (!APEX_ooo_empty(cpu)) {
+    return -1;
+  }
+
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    return -1;
+  }
+
+  APEX_Snapshot_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, APEX_SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = APEX_SNAPSHOT_VERSION;
+  header.header_size = sizeof(header);
+  header.code_size = cpu->code_memory_size;
+  header.code_checksum = APEX_cpu_code_checksum(cpu);
+
+  APEX_Snapshot_IO io = { fp, 1, 0, NULL };
+  io.failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+  transfer_cpu(&io, (APEX_CPU*)cpu);
+  if (fclose(fp) != 0) {
+    io.failed = 1;
+  }
+  return io.failed ? -1 : 0;
+}
+
+/*
+ * Resumes a cpu from a snapshot file. The cpu must hold the program the
+ * snapshot was taken from; it is left untouched unless 0 is returned.
+ */
+int
+APEX_cpu_restore(APEX_CPU* cpu, const char* filename)
+{
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    return -1;
+  }
+
+  APEX_Snapshot_Header header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, APEX_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != APEX_SNAPSHOT_VERSION ||
+      header.header_size < sizeof(header) ||
+      fseek(fp, header.header_size, SEEK_SET) != 0) {
+    fprintf(stderr, "APEX_Snapshot : %s is not a valid snapshot\n", filename);
+    fclose(fp);
+    return -1;
+  }
+  if (header.code_size != (uint32_t)cpu->code_memory_size ||
+      header.code_checksum != APEX_cpu_code_checksum(cpu)) {
+    fprintf(stderr,
+            "APEX_Snapshot : %s was taken from a different program\n",
+            filename);
+    fclose(fp);
+    return -1;
+  }
+
+  /* Read into a copy so that a truncated file leaves the cpu as it was */
+  APEX_CPU* restored = malloc(sizeof(*restored));
+  if (!restored) {
+    fclose(fp);
+    return -1;
+  }
+  *restored = *cpu;
+  for (int i = 0; i < NUM_STAGES; ++i) {
+    restored->stage[i] = restored->latches[i];
+  }
+  restored->dcache = cpu->dcache ? APEX_cache_copy(cpu->dcache) : NULL;
+  restored->icache = cpu->icache ? APEX_cache_copy(cpu->icache) : NULL;
+  APEX_memory_init(&restored->memory, cpu->memory.size);
+  if ((cpu->dcache && !restored->dcache) ||
+      (cpu->icache && !restored->icache)) {
+    free(restored->dcache);
+    free(restored->icache);
+    free(restored);
+    fclose(fp);
+    return -1;
+  }
+
+  APEX_Snapshot_IO io = { fp, 0, 0, NULL };
+  transfer_cpu(&io, restored);
+  fclose(fp);
+  if (io.failed) {
+    fprintf(stderr, "APEX_Snapshot : %s %s\n", filename,
+            io.mismatch ? io.mismatch : "is truncated");
+    free(restored->dcache);
+    free(restored->icache);
+    APEX_memory_free(&restored->memory);
+    free(restored);
+    return -1;
+  }
+  for (int i = F; i < NUM_STAGES; ++i) {
+    for (int k = cpu->width; k < APEX_MAX_WIDTH; ++k) {
+      if (restored->latches[i][k].pc != 0) {
+        fprintf(stderr,
+                "APEX_Snapshot : %s was taken with a wider pipeline\n",
+                filename);
+        free(restored->dcache);
+        free(restored->icache);
+        APEX_memory_free(&restored->memory);
+        free(restored);
+        return -1;
+      }
+    }
+  }
+
+  free(cpu->dcache);
+  free(cpu->icache);
+  APEX_memory_free(&cpu->memory);
+  *cpu = *restored;
+  free(restored);
+  for (int i = 0; i < NUM_STAGES; ++i) {
+    cpu->stage[i] = cpu->latches[i];
+  }
+  return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ *  threaded.c
+ *  Direct-threaded interpreter for architectural-only runs. Every
+ *  instruction of code memory is resolved once into the address of its
+ *  handler and its decoded operands, each handler jumps straight to the
+ *  next one. Compilers without labels as values get a switch instead.
+ */
+#include <stdlib.h>
+
+#include "cpu.h"
+
+#ifndef APEX_THREADED_GOTO
+#if defined(__GNUC__)
+#define APEX_THREADED_GOTO 1
+#else
+#define APEX_THREADED_GOTO 0
+#endif
+#endif
+
+/* Pseudo opcode ending a run: HALT, the end of code memory or stop_pc */
+#define THREADED_STOP NUM_OPCODES
+
+/* A pre-decoded instruction */
+typedef struct APEX_Threaded_Op
+{
+  const void* handler;	// Label of the opcode's handler
+  int opcode;		// OPCODE_* or THREADED_STOP
+  int rd;
+  int rs1;
+  int rs2;
+  int imm;
+  struct APEX_Threaded_Op* target;	// Taken branch successor, NULL if
+					// it lies outside of code memory
+  int target_pc;	// Taken branch target
+} APEX_Threaded_Op;
+
+/* Resolves code memory into ops, followed by a THREADED_STOP sentinel */
+static APEX_Threaded_Op*
+predecode(const APEX_CPU* cpu, const void* const* labels)
+{
+  int size = cpu->code_memory_size;
+  APEX_Threaded_Op* ops = calloc(size + 1, sizeof(*ops));
+  if (!ops) {
+    return NULL;
+  }
+
+  for (int i = 0; i < size; ++i) {
+    APEX_Instruction ins = cpu->code_memory[i];
+    APEX_Threaded_Op* op = &ops[i];
+    op->opcode = APEX_opcode(ins);
+    op->rd = APEX_rd(ins);
+    op->rs1 = APEX_rs1(ins);
+    op->rs2 = APEX_rs2(ins);
+    op->imm = APEX_imm(ins);
+    if (op->opcode >= NUM_OPCODES || op->opcode == OPCODE_HALT) {
+      op->opcode = THREADED_STOP;
+    } else if (opcode_info[op->opcode].flags & OPF_BRANCH) {
+      op->target_pc = APEX_branch_target(4000 + 4 * i, op->imm);
+      int target = get_code_index(op->target_pc);
+      op->target = (target >= 0 && target < size) ? &ops[target] : NULL;
+    }
+  }
+  ops[size].opcode = THREADED_STOP;
+
+  for (int i = 0; i <= size; ++i) {
+    ops[i].handler = labels ? labels[ops[i].opcode] : NULL;
+  }
+  return ops;
+}
+
+/*
+ * Same contract as APEX_cpu_fast_forward, dispatching through the
+ * pre-decoded program
+ */
+long
+APEX_cpu_threaded_run(APEX_CPU* cpu, long max_instructions, int stop_pc)
+{
+#if APEX_THREADED_GOTO
+  static const void* const labels[NUM_OPCODES + 1] = {
+    [OPCODE_NONE] = &&op_NOP,    [OPCODE_NOP] = &&op_NOP,
+    [OPCODE_MOVC] = &&op_MOVC,   [OPCODE_ADD] = &&op_ADD,
+    [OPCODE_ADDL] = &&op_ADDL,   [OPCODE_SUB] = &&op_SUB,
+    [OPCODE_SUBL] = &&op_SUBL,   [OPCODE_MUL] = &&op_MUL,
+    [OPCODE_AND] = &&op_AND,     [OPCODE_OR] = &&op_OR,
+    [OPCODE_EXOR] = &&op_EXOR,   [OPCODE_LOAD] = &&op_LOAD,
+    [OPCODE_STORE] = &&op_STORE, [OPCODE_BZ] = &&op_BZ,
+    [OPCODE_BNZ] = &&op_BNZ,     [OPCODE_HALT] = &&op_STOP,
+    [THREADED_STOP] = &&op_STOP,
+  };
+#else
+  static const void* const* labels = NULL;
+#endif
+
+  if (!APEX_cpu_pipeline_empty(cpu)) {
+    return -1;
+  }
+  if (!cpu->threaded_code) {
+    cpu->threaded_code = predecode(cpu, labels);
+    if (!cpu->threaded_code) {
+      return APEX_cpu_fast_forward(cpu, max_instructions, stop_pc);
+    }
+  }
+
+  int index = get_code_index(cpu->pc);
+  if (index < 0 || index >= cpu->code_memory_size) {
+    return 0;
+  }
+
+  /* stop_pc is turned into a sentinel for the length of the run */
+  APEX_Threaded_Op* ops = cpu->threaded_code;
+  APEX_Threaded_Op* stop_op = NULL;
+  APEX_Threaded_Op saved = { 0 };
+  int stop_index = get_code_index(stop_pc);
+  if (stop_pc % 4 == 0 && stop_index >= 0 &&
+      stop_index < cpu->code_memory_size) {
+    stop_op = &ops[stop_index];
+    saved = *stop_op;
+    stop_op->opcode = THREADED_STOP;
+    stop_op->handler = ops[cpu->code_memory_size].handler;
+  }
+
+  APEX_Threaded_Op* ip = &ops[index];
+  int* regs = cpu->regs;
+  int zero_flag = cpu->zero_flag;
+  int pc;
+  long executed = 0;
+
+#if APEX_THREADED_GOTO
+#define OP(name) op_##name
+#define NEXT                                                                   \
+  do {                                                                         \
+    if (executed == max_instructions) {                                        \
+      goto stopped;                                                            \
+    }                                                                          \
+    executed++;                                                                \
+    goto *ip->handler;                                                         \
+  } while (0)
+
+  NEXT;
+#else
+#define OP(name) case OPCODE_##name
+#define OPCODE_STOP THREADED_STOP
+#define NEXT continue
+
+  for (;;) {
+    if (executed == max_instructions) {
+      goto stopped;
+    }
+    executed++;
+    switch (ip->opcode) {
+    default:
+#endif
+
+  OP(NOP):
+    ip++;
+    NEXT;
+  OP(MOVC):
+    regs[ip->rd] = ip->imm;
+    ip++;
+    NEXT;
+  OP(ADD):
+    regs[ip->rd] = regs[ip->rs1] + regs[ip->rs2];
+    zero_flag = (regs[ip->rd] == 0);
+    ip++;
+    NEXT;
+  OP(ADDL):
+    regs[ip->rd] = regs[ip->rs1] + ip->imm;
+    ip++;
+    NEXT;
+  OP(SUB):
+    regs[ip->rd] = regs[ip->rs1] - regs[ip->rs2];
+    zero_flag = (regs[ip->rd] == 0);
+    ip++;
+    NEXT;
+  OP(SUBL):
+    regs[ip->rd] = regs[ip->rs1] - ip->imm;
+    ip++;
+    NEXT;
+  OP(MUL):
+    regs[ip->rd] = regs[ip->rs1] * regs[ip->rs2];
+    zero_flag = (regs[ip->rd] == 0);
+    ip++;
+    NEXT;
+  OP(AND):
+    regs[ip->rd] = regs[ip->rs1] & regs[ip->rs2];
+    ip++;
+    NEXT;
+  OP(OR):
+    regs[ip->rd] = regs[ip->rs1] | regs[ip->rs2];
+    ip++;
+    NEXT;
+  OP(EXOR):
+    regs[ip->rd] = regs[ip->rs1] ^ regs[ip->rs2];
+    ip++;
+    NEXT;
+  OP(LOAD):
+    regs[ip->rd] = APEX_mem_load(cpu, regs[ip->rs1] + ip->imm);
+    ip++;
+    NEXT;
+  OP(STORE):
+    APEX_mem_store(cpu, regs[ip->rs2] + ip->imm, regs[ip->rs1]);
+    ip++;
+    NEXT;
+  OP(BZ):
+    if (!zero_flag) {
+      ip++;
+    } else if (ip->target) {
+      ip = ip->target;
+    } else {
+      goto left_code;
+    }
+    NEXT;
+  OP(BNZ):
+    if (zero_flag) {
+      ip++;
+    } else if (ip->target) {
+      ip = ip->target;
+    } else {
+      goto left_code;
+    }
+    NEXT;
+  OP(STOP):
+    executed--;
+    goto stopped;
+
+#if !APEX_THREADED_GOTO
+    }
+  }
+#endif
+
+left_code:
+  pc = ip->target_pc;
+  goto done;
+
+stopped:
+  pc = 4000 + 4 * (ip - ops);
+
+done:
+  if (stop_op) {
+    *stop_op = saved;
+  }
+  cpu->pc = pc;
+  cpu->zero_flag = zero_flag;
+  cpu->fast_forwarded += executed;
+  return executed;
+}
@@ -0,0 +1,171 @@
+/*
+ *  trace.c
+ *  Records the pipeline view of every simulated cycle as a fixed-size
+ *  binary record. Records go into a lock-free single-producer,
+ *  single-consumer ring buffer and a writer thread drains them to a file,
+ *  so the simulator does no formatting and no I/O of its own.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu.h"
+
+#define APEX_TRACE_RING_SIZE 4096	// Records, a power of two
+
+typedef struct APEX_Trace
+{
+  APEX_Trace_Record ring[APEX_TRACE_RING_SIZE];
+
+  /* Records published by the simulator and records written out. Each is
+   * advanced by one side only and kept on its own cache line.
+   */
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+
+  _Alignas(64) _Atomic int done;	// Set once the simulator is finished
+  APEX_Trace_Record* current;	// Record of the cycle being simulated
+  FILE* fp;
+  int failed;			// Set by the writer on a write error
+  pthread_t writer;
+} APEX_Trace;
+
+/* Writer thread: moves published records to the file in contiguous runs */
+static void*
+writer_main(void* arg)
+{
+  APEX_Trace* trace = arg;
+  const struct timespec idle = { 0, 200000 };
+
+  for (;;) {
+    uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+    if (head == tail) {
+      if (atomic_load_explicit(&trace->done, memory_order_acquire) &&
+          atomic_load_explicit(&trace->head, memory_order_acquire) == tail) {
+        break;
+      }
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    uint64_t start = tail % APEX_TRACE_RING_SIZE;
+    uint64_t count = head - tail;
+    if (count > APEX_TRACE_RING_SIZE - start) {
+      count = APEX_TRACE_RING_SIZE - start;
+    }
+    if (!trace->failed &&
+        fwrite(&trace->ring[start], sizeof(APEX_Trace_Record), count,
+               trace->fp) != count) {
+      trace->failed = 1;
+    }
+    atomic_store_explicit(&trace->tail, tail + count, memory_order_release);
+  }
+  return NULL;
+}
+
+/*
+ * Starts tracing every cycle the cpu simulates into filename, returns 0 on
+ * success
+ */
+int
+APEX_trace_open(APEX_CPU* cpu, const char* filename)
+{
+  if (cpu->trace) {
+    return -1;
+  }
+
+  APEX_Trace* trace = calloc(1, sizeof(*trace));
+  if (!trace) {
+    return -1;
+  }
+  trace->fp = fopen(filename, "wb");
+  if (!trace->fp) {
+    free(trace);
+    return -1;
+  }
+
+  APEX_Trace_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, APEX_TRACE_MAGIC, sizeof(header.magic));
+  header.version = APEX_TRACE_VERSION;
+  header.header_size = sizeof(header);
+  header.record_size = sizeof(APEX_Trace_Record);
+  header.code_size = cpu->code_memory_size;
+  header.code_checksum = APEX_cpu_code_checksum(cpu);
+  header.depth = cpu->pipeline.depth;
+  if (fwrite(&header, sizeof(header), 1, trace->fp) != 1 ||
+      pthread_create(&trace->writer, NULL, writer_main, trace) != 0) {
+    fclose(trace->fp);
+    free(trace);
+    return -1;
+  }
+
+  cpu->trace = trace;
+  return 0;
+}
+
+/*
+ * Stops tracing once every record is written, returns 0 if the trace file
+ * is complete
+ */
+int
+APEX_trace_close(APEX_CPU* cpu)
+{
+  APEX_Trace* trace = cpu->trace;
+  if (!trace) {
+    return 0;
+  }
+
+  atomic_store_explicit(&trace->done, 1, memory_order_release);
+  pthread_join(trace->writer, NULL);
+  int failed = trace->failed;
+  if (fclose(trace->fp) != 0) {
+    failed = 1;
+  }
+  free(trace);
+  cpu->trace = NULL;
+  return failed ? -1 : 0;
+}
+
+/*
+ * Claims the next ring slot for the cycle about to be simulated, waiting
+ * for the writer while the ring is full
+ */
+void
+APEX_trace_begin_cycle(APEX_Trace* trace, int clock)
+{
+  uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+  while (head - atomic_load_explicit(&trace->tail, memory_order_acquire) ==
+         APEX_TRACE_RING_SIZE) {
+    sched_yield();
+  }
+
+  trace->current = &trace->ring[head % APEX_TRACE_RING_SIZE];
+  memset(trace->current, 0, sizeof(*trace->current));
+  trace->current->clock = clock;
+}
+
+/* Records the latch stage id shows in this cycle */
+void
+APEX_trace_stage(APEX_Trace* trace, int id, const CPU_Stage* stage)
+{
+  APEX_Trace_Stage* slot = &trace->current->stage[id];
+  slot->pc = stage->pc;
+  slot->index = stage->index;
+  slot->opcode = stage->opcode;
+  slot->flags = APEX_TRACE_SHOWN | (stage->busy ? APEX_TRACE_BUSY : 0) |
+                (stage->stalled ? APEX_TRACE_STALLED : 0);
+}
+
+/* Publishes the record of the cycle just simulated to the writer */
+void
+APEX_trace_end_cycle(APEX_Trace* trace)
+{
+  uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+  atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
@@ -0,0 +1,128 @@
+/*
+ *  units.c
+ *  Timing of the functional units: the latency and initiation interval of
+ *  each class of instructions, read from a units file such as
+ *
+ *    # unit   latency    interval
+ *    mul      latency=4  iterative
+ *    mem      latency=2  interval=1
+ *
+ *  A unit not listed keeps the timing of the original pipeline.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+static const char* const unit_names[APEX_NUM_UNITS] = {
+  [APEX_UNIT_ALU] = "alu",
+  [APEX_UNIT_MUL] = "mul",
+  [APEX_UNIT_MEM] = "mem",
+  [APEX_UNIT_BRANCH] = "branch",
+};
+
+/*
+ * Gives every unit a latency of one cycle, pipelined
+ */
+void
+APEX_units_reset(APEX_Unit_Config* units)
+{
+  for (int i = 0; i < APEX_NUM_UNITS; ++i) {
+    units[i].latency = 1;
+    units[i].interval = 1;
+  }
+}
+
+static int
+parse_cycles(const char* text, int* cycles)
+{
+  char* end;
+  long value = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || value < 1 ||
+      value > APEX_UNIT_MAX_CYCLES) {
+    return -1;
+  }
+  *cycles = value;
+  return 0;
+}
+
+/* Applies one "<unit> <setting>..." line, returns 0 on success */
+static int
+parse_line(APEX_Unit_Config* units, char* line)
+{
+  const char* separators = " \t\r\n";
+  char* saveptr;
+  char* name = strtok_r(line, separators, &saveptr);
+  if (!name) {
+    return 0;
+  }
+
+  int unit = 0;
+  while (unit < APEX_NUM_UNITS && strcmp(name, unit_names[unit]) != 0) {
+    unit++;
+  }
+  if (unit == APEX_NUM_UNITS) {
+    return -1;
+  }
+
+  APEX_Unit_Config config = { 1, 1 };
+  int iterative = 0;
+  for (char* word = strtok_r(NULL, separators, &saveptr); word;
+       word = strtok_r(NULL, separators, &saveptr)) {
+    if (strncmp(word, "latency=", 8) == 0) {
+      if (parse_cycles(word + 8, &config.latency) != 0) {
+        return -1;
+      }
+    } else if (strncmp(word, "interval=", 9) == 0) {
+      if (parse_cycles(word + 9, &config.interval) != 0) {
+        return -1;
+      }
+    } else if (strcmp(word, "iterative") == 0) {
+      iterative = 1;
+    } else if (strcmp(word, "pipelined") == 0) {
+      config.interval = 1;
+    } else {
+      return -1;
+    }
+  }
+  if (iterative) {
+    config.interval = config.latency;
+  }
+  units[unit] = config;
+  return 0;
+}
+
+/*
+ * Reads the timing of the units listed in filename, returns 0 on success.
+ * Blank lines and text after a '#' are ignored.
+ */
+int
+APEX_units_load(APEX_Unit_Config* units, const char* filename)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "APEX_Units : Unable to read %s\n", filename);
+    return -1;
+  }
+
+  char line[256];
+  int number = 0;
+  int failed = 0;
+  while (!failed && fgets(line, sizeof(line), fp)) {
+    number++;
+    char* comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    if (parse_line(units, line) != 0) {
+      fprintf(stderr,
+              "APEX_Units : %s:%d: expected alu|mul|mem|branch"
+              " [latency=<cycles>] [interval=<cycles>|pipelined|iterative]\n",
+              filename, number);
+      failed = 1;
+    }
+  }
+  fclose(fp);
+  return failed ? -1 : 0;
+}